@@ -1,22 +1,508 @@
 #include "checkpointRestart.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
 #include <inttypes.h>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <linux/userfaultfd.h>
 #include <map>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include <string.h>
+#include <poll.h>
 #include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-ACRIiLState::~ACRIiLState() {
-  deleteAndNull(checkpointBaseDirectory);
-  deleteAndNull(currentCheckpointDirectory);
-  deleteAndNull(restartBaseDirectory);
-  for (auto pair : heapMemory) {
-    deleteAndNull(pair.second);
+int32_t __acriilCheckpointDue = 0;
+
+// the only instance, the other runtime modules refer to it through the
+// declaration in the header
+ACRIiLState state;
+
+// the kernel will not transfer more than this in a single call
+#define __ACRIIL_MAX_IO_SIZE (1ULL << 30)
+
+bool __acriilWriteAll(int fd, const void *buf, uint64_t count,
+                      uint64_t offset) {
+  const char *ptr = (const char *)buf;
+  while (count) {
+    const uint64_t size = std::min<uint64_t>(count, __ACRIIL_MAX_IO_SIZE);
+    ssize_t written = pwrite(fd, ptr, size, offset);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    ptr += written;
+    offset += written;
+    count -= written;
+  }
+  return true;
+}
+
+bool __acriilReadAll(int fd, void *buf, uint64_t count, uint64_t offset) {
+  char *ptr = (char *)buf;
+  while (count) {
+    const uint64_t size = std::min<uint64_t>(count, __ACRIIL_MAX_IO_SIZE);
+    ssize_t read = pread(fd, ptr, size, offset);
+    if (read == -1 && errno == EINTR)
+      continue;
+    if (read <= 0)
+      return false;
+    ptr += read;
+    offset += read;
+    count -= read;
+  }
+  return true;
+}
+
+bool __acriilReadBits(int fd, uint8_t *data, uint64_t totalBits,
+                      uint64_t offset) {
+  const uint64_t fullBytes = totalBits / 8;
+  const uint64_t remainingBits = totalBits % 8;
+  if (!remainingBits)
+    return __acriilReadAll(fd, data, fullBytes, offset);
+
+  // read the full bytes and the trailing partial byte in one go
+  uint8_t lastByte;
+  struct iovec iov[2];
+  iov[0].iov_base = data;
+  iov[0].iov_len = fullBytes;
+  iov[1].iov_base = &lastByte;
+  iov[1].iov_len = 1;
+  ssize_t read = -1;
+  if (fullBytes < __ACRIIL_MAX_IO_SIZE) {
+    do {
+      read = preadv(fd, iov, 2, offset);
+    } while (read == -1 && errno == EINTR);
+  }
+  // fall back to separate reads on a short (or too large) transfer
+  if (read != (ssize_t)(fullBytes + 1) &&
+      (!__acriilReadAll(fd, data, fullBytes, offset) ||
+       !__acriilReadAll(fd, &lastByte, 1, offset + fullBytes)))
+    return false;
+
+  // make sure to not overwrite other data when writing less than a byte
+  uint8_t mask = (uint8_t)(0xff << remainingBits);
+  data[fullBytes] = (data[fullBytes] & mask) | (lastByte & ~mask);
+  return true;
+}
+
+// CRC32C (Castagnoli) with slicing-by-8 tables, the SSE 4.2 instruction is
+// used instead when the CPU has it
+static uint32_t __acriilCrc32cTables[8][256];
+
+static bool __acriilCrc32cInit() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+    __acriilCrc32cTables[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int t = 1; t < 8; t++) {
+      const uint32_t previous = __acriilCrc32cTables[t - 1][i];
+      __acriilCrc32cTables[t][i] =
+          (previous >> 8) ^ __acriilCrc32cTables[0][previous & 0xff];
+    }
+  }
+  return true;
+}
+
+static uint32_t __acriilCrc32cSoftware(uint32_t crc, const uint8_t *data,
+                                       uint64_t length) {
+  static bool initialised = __acriilCrc32cInit();
+  (void)initialised;
+  const uint32_t(*t)[256] = __acriilCrc32cTables;
+  for (; length >= 8; data += 8, length -= 8) {
+    uint32_t low;
+    uint32_t high;
+    memcpy(&low, data, sizeof(low));
+    memcpy(&high, data + 4, sizeof(high));
+    low ^= crc;
+    crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^
+          t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^ t[3][high & 0xff] ^
+          t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^
+          t[0][high >> 24];
+  }
+  for (; length; data++, length--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+__acriilCrc32cHardware(uint32_t crc, const uint8_t *data, uint64_t length) {
+  uint64_t crc64 = crc;
+  for (; length >= 8; data += 8, length -= 8) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    crc64 = _mm_crc32_u64(crc64, value);
+  }
+  crc = crc64;
+  for (; length; data++, length--)
+    crc = _mm_crc32_u8(crc, *data);
+  return crc;
+}
+#endif
+
+uint32_t __acriilCrc32c(const void *data, uint64_t length, uint32_t crc) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  static bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware)
+    return ~__acriilCrc32cHardware(crc, (const uint8_t *)data, length);
+#endif
+  return ~__acriilCrc32cSoftware(crc, (const uint8_t *)data, length);
+}
+
+static inline uint64_t __acriilRotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t __acriilFmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+void __acriilHash128(const void *data, uint64_t length, uint64_t hash[2]) {
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  const uint8_t *bytes = (const uint8_t *)data;
+  uint64_t h1 = 0, h2 = 0;
+  uint64_t k1, k2;
+  for (uint64_t i = 0; i + 16 <= length; i += 16) {
+    memcpy(&k1, bytes + i, sizeof(k1));
+    memcpy(&k2, bytes + i + 8, sizeof(k2));
+    h1 ^= __acriilRotl64(k1 * c1, 31) * c2;
+    h1 = (__acriilRotl64(h1, 27) + h2) * 5 + 0x52dce729;
+    h2 ^= __acriilRotl64(k2 * c2, 33) * c1;
+    h2 = (__acriilRotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+  }
+  // the tail is read as little endian words padded with zeros
+  const uint64_t tail = length % 16;
+  k1 = k2 = 0;
+  if (tail > 8)
+    memcpy(&k2, bytes + length - tail + 8, tail - 8);
+  memcpy(&k1, bytes + length - tail, std::min<uint64_t>(tail, 8));
+  if (tail > 8)
+    h2 ^= __acriilRotl64(k2 * c2, 33) * c1;
+  if (tail)
+    h1 ^= __acriilRotl64(k1 * c1, 31) * c2;
+  h1 ^= length;
+  h2 ^= length;
+  h1 += h2;
+  h2 += h1;
+  h1 = __acriilFmix64(h1);
+  h2 = __acriilFmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  hash[0] = h1;
+  hash[1] = h2;
+}
+
+void __acriilAddIOTasks(std::vector<ACRIiLIOTask> &tasks, int fd, char *data,
+                        uint64_t length, uint64_t offset, bool write) {
+  for (uint64_t done = 0; done < length; done += __ACRIIL_IO_CHUNK_SIZE) {
+    ACRIiLIOTask task = {
+        fd, data + done,
+        std::min<uint64_t>(length - done, __ACRIIL_IO_CHUNK_SIZE),
+        offset + done, write};
+    tasks.push_back(task);
+  }
+}
+
+bool __acriilRunIOTask(ACRIiLIOTask &task) {
+  if (task.write)
+    return __acriilWriteAll(task.fd, task.data, task.length, task.offset);
+  return __acriilReadAll(task.fd, task.data, task.length, task.offset);
+}
+
+// bytes which are shuffled together, elements which are not a whole number
+// of bytes are left as they are
+static uint64_t __acriilShuffleWidth(uint64_t elementSizeBits) {
+  if (elementSizeBits % 8 || elementSizeBits < 16 || elementSizeBits > 128)
+    return 1;
+  return elementSizeBits / 8;
+}
+
+static void __acriilShuffle(const char *in, char *out, uint64_t length,
+                            uint64_t width) {
+  const uint64_t elements = length / width;
+  for (uint64_t b = 0; b < width; b++) {
+    for (uint64_t i = 0; i < elements; i++)
+      out[b * elements + i] = in[i * width + b];
+  }
+  memcpy(out + elements * width, in + elements * width,
+         length - elements * width);
+}
+
+static void __acriilUnshuffle(const char *in, char *out, uint64_t length,
+                              uint64_t width) {
+  const uint64_t elements = length / width;
+  for (uint64_t b = 0; b < width; b++) {
+    for (uint64_t i = 0; i < elements; i++)
+      out[i * width + b] = in[b * elements + i];
+  }
+  memcpy(out + elements * width, in + elements * width,
+         length - elements * width);
+}
+
+// run length encoding, a control byte below 128 is followed by that many
+// plus one literal bytes, otherwise the next byte is repeated control - 125
+// times
+static uint64_t __acriilRLEEncode(const uint8_t *in, uint64_t length,
+                                  uint8_t *out, uint64_t capacity) {
+  uint64_t ip = 0;
+  uint64_t op = 0;
+  while (ip < length) {
+    uint64_t run = 1;
+    while (ip + run < length && run < 130 && in[ip + run] == in[ip])
+      run++;
+    if (run >= 3) {
+      if (op + 2 > capacity)
+        return 0;
+      out[op++] = run + 125;
+      out[op++] = in[ip];
+      ip += run;
+      continue;
+    }
+    // literals up to the next run of at least three bytes
+    uint64_t literals = 0;
+    while (ip + literals < length && literals < 128) {
+      const uint8_t *next = in + ip + literals;
+      if (ip + literals + 2 < length && next[0] == next[1] &&
+          next[0] == next[2])
+        break;
+      literals++;
+    }
+    if (op + 1 + literals > capacity)
+      return 0;
+    out[op++] = literals - 1;
+    memcpy(out + op, in + ip, literals);
+    op += literals;
+    ip += literals;
+  }
+  return op;
+}
+
+static bool __acriilRLEDecode(const uint8_t *in, uint64_t storedLength,
+                              uint8_t *out, uint64_t length) {
+  uint64_t ip = 0;
+  uint64_t op = 0;
+  while (ip < storedLength) {
+    const uint8_t control = in[ip++];
+    if (control < 128) {
+      const uint64_t literals = control + 1;
+      if (literals > storedLength - ip || literals > length - op)
+        return false;
+      memcpy(out + op, in + ip, literals);
+      ip += literals;
+      op += literals;
+    } else {
+      const uint64_t run = control - 125;
+      if (ip == storedLength || run > length - op)
+        return false;
+      memset(out + op, in[ip++], run);
+      op += run;
+    }
+  }
+  return op == length;
+}
+
+#define __ACRIIL_LZ_HASH_BITS 14
+#define __ACRIIL_LZ_MIN_MATCH 4
+
+static bool __acriilPutVarint(uint8_t *out, uint64_t capacity, uint64_t &op,
+                              uint64_t value) {
+  do {
+    if (op == capacity)
+      return false;
+    const uint8_t byte = value & 0x7f;
+    value >>= 7;
+    out[op++] = byte | (value ? 0x80 : 0);
+  } while (value);
+  return true;
+}
+
+static bool __acriilGetVarint(const uint8_t *in, uint64_t length,
+                              uint64_t &ip, uint64_t &value) {
+  value = 0;
+  for (uint64_t shift = 0; shift < 64; shift += 7) {
+    if (ip == length)
+      return false;
+    const uint8_t byte = in[ip++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// LZ77 which finds matches through a hash table of the last position of
+// every 4 byte sequence, the output is a list of (literal count, literals,
+// match length, distance) sequences and a match length of 0 ends it
+static uint64_t __acriilLZEncode(const uint8_t *in, uint64_t length,
+                                 uint8_t *out, uint64_t capacity) {
+  std::vector<uint64_t> table(1 << __ACRIIL_LZ_HASH_BITS, 0);
+  uint64_t ip = 0;
+  uint64_t anchor = 0;
+  uint64_t op = 0;
+  while (ip + __ACRIIL_LZ_MIN_MATCH <= length) {
+    uint32_t sequence;
+    memcpy(&sequence, in + ip, sizeof(sequence));
+    const uint32_t hash =
+        (sequence * 2654435761u) >> (32 - __ACRIIL_LZ_HASH_BITS);
+    // positions are stored plus one, so 0 means no candidate
+    const uint64_t candidate = table[hash];
+    table[hash] = ip + 1;
+    if (!candidate ||
+        memcmp(in + candidate - 1, in + ip, __ACRIIL_LZ_MIN_MATCH)) {
+      ip++;
+      continue;
+    }
+    const uint64_t match = candidate - 1;
+    uint64_t matchLength = __ACRIIL_LZ_MIN_MATCH;
+    while (ip + matchLength < length &&
+           in[match + matchLength] == in[ip + matchLength])
+      matchLength++;
+    const uint64_t literals = ip - anchor;
+    if (!__acriilPutVarint(out, capacity, op, literals) ||
+        literals > capacity - op)
+      return 0;
+    memcpy(out + op, in + anchor, literals);
+    op += literals;
+    if (!__acriilPutVarint(out, capacity, op,
+                           matchLength - __ACRIIL_LZ_MIN_MATCH + 1) ||
+        !__acriilPutVarint(out, capacity, op, ip - match))
+      return 0;
+    ip += matchLength;
+    anchor = ip;
+  }
+  const uint64_t literals = length - anchor;
+  if (!__acriilPutVarint(out, capacity, op, literals) ||
+      literals > capacity - op)
+    return 0;
+  memcpy(out + op, in + anchor, literals);
+  op += literals;
+  if (!__acriilPutVarint(out, capacity, op, 0))
+    return 0;
+  return op;
+}
+
+static bool __acriilLZDecode(const uint8_t *in, uint64_t storedLength,
+                             uint8_t *out, uint64_t length) {
+  uint64_t ip = 0;
+  uint64_t op = 0;
+  while (true) {
+    uint64_t literals;
+    if (!__acriilGetVarint(in, storedLength, ip, literals) ||
+        literals > storedLength - ip || literals > length - op)
+      return false;
+    memcpy(out + op, in + ip, literals);
+    ip += literals;
+    op += literals;
+    uint64_t matchLength;
+    if (!__acriilGetVarint(in, storedLength, ip, matchLength))
+      return false;
+    if (!matchLength)
+      return op == length && ip == storedLength;
+    matchLength += __ACRIIL_LZ_MIN_MATCH - 1;
+    uint64_t distance;
+    if (!__acriilGetVarint(in, storedLength, ip, distance) || !distance ||
+        distance > op || matchLength > length - op)
+      return false;
+    // the match can overlap with the bytes it produces
+    for (uint64_t i = 0; i < matchLength; i++, op++)
+      out[op] = out[op - distance];
+  }
+}
+
+const char *__acriilCodecName(uint64_t codec) {
+  switch (codec) {
+  case ACRIIL_CODEC_NONE:
+    return "none";
+  case ACRIIL_CODEC_SHUFFLE_RLE:
+    return "shuffle-rle";
+  case ACRIIL_CODEC_SHUFFLE_LZ:
+    return "shuffle-lz";
   }
-  heapMemory.clear();
-  for (auto pair : stackMemory) {
-    deleteAndNull(pair.second);
+  return "unknown";
+}
+
+bool __acriilCodecFromName(const char *name, uint64_t &codec) {
+  for (uint64_t c = 0; c < ACRIIL_CODEC_COUNT; c++) {
+    if (!strcmp(name, __acriilCodecName(c))) {
+      codec = c;
+      return true;
+    }
   }
-  stackMemory.clear();
+  return false;
+}
+
+uint64_t __acriilEncode(uint64_t codec, uint64_t elementSizeBits,
+                        const char *data, uint64_t length, char *out) {
+  if (codec == ACRIIL_CODEC_NONE || length < 2)
+    return 0;
+  std::vector<char> shuffled(length);
+  __acriilShuffle(data, shuffled.data(), length,
+                  __acriilShuffleWidth(elementSizeBits));
+  // anything which is not smaller than the input is stored as it is
+  const uint8_t *in = (const uint8_t *)shuffled.data();
+  if (codec == ACRIIL_CODEC_SHUFFLE_RLE)
+    return __acriilRLEEncode(in, length, (uint8_t *)out, length - 1);
+  return __acriilLZEncode(in, length, (uint8_t *)out, length - 1);
+}
+
+bool __acriilDecode(uint64_t codec, uint64_t elementSizeBits, const char *in,
+                    uint64_t storedLength, char *out, uint64_t length) {
+  std::vector<char> shuffled(length);
+  uint8_t *decoded = (uint8_t *)shuffled.data();
+  if (codec == ACRIIL_CODEC_SHUFFLE_RLE) {
+    if (!__acriilRLEDecode((const uint8_t *)in, storedLength, decoded, length))
+      return false;
+  } else if (codec == ACRIIL_CODEC_SHUFFLE_LZ) {
+    if (!__acriilLZDecode((const uint8_t *)in, storedLength, decoded, length))
+      return false;
+  } else {
+    return false;
+  }
+  __acriilUnshuffle(shuffled.data(), out, length,
+                    __acriilShuffleWidth(elementSizeBits));
+  return true;
+}
+
+ACRIiLState::~ACRIiLState() {
+  // flush any checkpoint that is still being written
+  stopWriter();
+  // checkpoints which are only on the local level are flushed out
+  stopFlusher();
+  stopCollector();
+  stopTimer();
+  stopIOThreads();
+  stopLazyRestore();
+  deleteAndNull(checkpointJob);
+  deleteAndNull(flushDirectory);
+  writeStats();
+  closeRestartFds();
+  if (pagemapFd != -1)
+    close(pagemapFd);
+  deleteAndNull(checkpointBaseDirectory);
+  deleteAndNull(currentCheckpointFileName);
+  deleteAndNull(restartDirectory);
 }
 
 uint64_t ACRIiLState::getTimeInMicroseconds() {
@@ -48,12 +534,118 @@ bool ACRIiLState::checkpointSetup() {
             << std::setprecision(2) << ((double)checkpointInterval) / 1000000.0
             << "s ***" << std::endl;
 
+  // with the mean time between failures the interval adapts to the measured
+  // cost of the checkpoints
+  if (const char *mtbf = std::getenv("ACRIIL_MTBF")) {
+    char *end;
+    double val = strtod(mtbf, &end);
+    if (mtbf != end && val > 0) {
+      meanTimeBetweenFailures = val * 1000000;
+      std::cerr << "*** ACRIiL - adapting the checkpoint interval to a MTBF "
+                << "of " << std::fixed << std::setprecision(2) << val
+                << "s ***" << std::endl;
+    }
+  }
+
+  // checkpoints can be written out by a background thread
+  if (const char *async = std::getenv("ACRIIL_ASYNC")) {
+    asyncCheckpointing = atoi(async) != 0;
+  }
+  if (asyncCheckpointing) {
+    std::cerr << "*** ACRIiL - checkpoints are written asynchronously ***"
+              << std::endl;
+  }
+
+  // large buffers are written and read by several threads
+  if (const char *threads = std::getenv("ACRIIL_IO_THREADS")) {
+    char *end;
+    uint64_t val = strtoull(threads, &end, 10);
+    if (threads != end && val > 0) {
+      setIOThreadCount(val);
+    }
+  }
+  if (ioThreadCount > 1) {
+    std::cerr << "*** ACRIiL - using " << ioThreadCount
+              << " threads for checkpoint I/O ***" << std::endl;
+  }
+
+  // the payload can be encoded before it is written
+  if (const char *name = std::getenv("ACRIIL_CODEC")) {
+    if (!__acriilCodecFromName(name, codec)) {
+      std::cerr << "*** ACRIiL - unknown codec " << name
+                << ", the payload will not be encoded ***" << std::endl;
+      codec = ACRIIL_CODEC_NONE;
+    }
+  }
+  if (codec != ACRIIL_CODEC_NONE) {
+    std::cerr << "*** ACRIiL - encoding the payload with "
+              << __acriilCodecName(codec) << " ***" << std::endl;
+  }
+
+  // delete the checkpoints which are no longer needed for a restart
+  if (const char *keep = std::getenv("ACRIIL_KEEP_CHECKPOINTS")) {
+    keepCheckpoints = strtoull(keep, nullptr, 10);
+    if (keepCheckpoints) {
+      std::cerr << "*** ACRIiL - keeping the last " << keepCheckpoints
+                << " checkpoints ***" << std::endl;
+    }
+  }
+
+  // store chunks which are already in the previous checkpoint only once
+  if (const char *dedup = std::getenv("ACRIIL_DEDUP")) {
+    deduplicating = atoi(dedup) != 0;
+    if (deduplicating) {
+      std::cerr << "*** ACRIiL - deduplicating chunks of "
+                << __ACRIIL_DEDUP_CHUNK_SIZE << " bytes ***" << std::endl;
+    }
+  }
+
+  // only write the pages which changed since the previous checkpoint
+  if (const char *incremental = std::getenv("ACRIIL_INCREMENTAL")) {
+    incrementalCheckpointing = atoi(incremental) != 0;
+  }
+  if (const char *every = std::getenv("ACRIIL_FULL_CHECKPOINT_EVERY")) {
+    char *end;
+    uint64_t val = strtoull(every, &end, 10);
+    if (every != end && val > 0) {
+      fullCheckpointEvery = val;
+    }
+  }
+  if (incrementalCheckpointing) {
+    incrementalCheckpointing = incrementalSetup();
+    std::cerr << "*** ACRIiL - incremental checkpointing "
+              << (incrementalCheckpointing
+                      ? "enabled"
+                      : "is not supported by the kernel, disabled")
+              << " ***" << std::endl;
+  }
+
   // set up the base path
+  const std::string epochDirectory =
+      __ACRIIL_CHECKPOINT_PREFIX + std::to_string(currentTime) + "/";
   deleteAndNull(checkpointBaseDirectory);
-  checkpointBaseDirectory =
-      new std::string(".acriil_chkpnt-" + std::to_string(currentTime) + "/");
+  checkpointBaseDirectory = new std::string(epochDirectory);
+
+  // with a local directory the checkpoints are written there and flushed to
+  // the working directory in the background
+  localDirectory = getLocalDirectory();
+  if (!localDirectory.empty()) {
+    if (const char *every = std::getenv("ACRIIL_FLUSH_EVERY")) {
+      char *end;
+      uint64_t val = strtoull(every, &end, 10);
+      if (every != end && val > 0)
+        flushEvery = val;
+    }
+    deleteAndNull(flushDirectory);
+    flushDirectory = checkpointBaseDirectory;
+    checkpointBaseDirectory =
+        new std::string(localDirectory + "/" + epochDirectory);
+    std::cerr << "*** ACRIiL - checkpointing to " << localDirectory
+              << ", every " << flushEvery
+              << ". checkpoint is flushed to the working directory ***"
+              << std::endl;
+  }
 
-  updateNextCheckpointTime();
   return checkpointsEnabled();
 }
 
@@ -64,9 +656,22 @@ void ACRIiLState::checkpointStart() {
     stopCurrentCheckpoint();
     return;
   }
+  // the cost includes waiting for the previous checkpoint to be written
+  checkpointStartTime = getTimeInMicroseconds();
 
-  deleteAndNull(currentCheckpointDirectory);
-  currentCheckpointDirectory = new std::string(
+  // only one checkpoint can be in flight
+  if (isAsyncCheckpointing()) {
+    waitForWriter();
+    // the next checkpoint cannot reference a checkpoint which failed
+    if (writerFailed) {
+      resetTrackedVariables();
+      resetChunks();
+      writerFailed = false;
+    }
+  }
+
+  deleteAndNull(currentCheckpointFileName);
+  currentCheckpointFileName = new std::string(
       getCheckpointBaseDirectory() + std::to_string(checkpointCounter));
 
   currentCheckpointArgumentIndexCounter = 0;
@@ -79,20 +684,36 @@ std::string &ACRIiLState::getCheckpointBaseDirectory() {
   return *checkpointBaseDirectory;
 }
 
-std::string &ACRIiLState::getCurrentCheckpointDirectory() {
-  return *currentCheckpointDirectory;
+std::string &ACRIiLState::getCurrentCheckpointFileName() {
+  return *currentCheckpointFileName;
 }
 
+int64_t ACRIiLState::getCheckpointCounter() { return checkpointCounter; }
+
 void ACRIiLState::finishCheckpoint() {
   if (performCurrentCheckpoint()) {
     checkpointCounter++;
+    // smooth the cost, single checkpoints can be slowed down by the system
+    const double cost = getTimeInMicroseconds() - checkpointStartTime;
+    const double weight =
+        checkpointCost == 0 ? 1 : __ACRIIL_CHECKPOINT_COST_WEIGHT;
+    checkpointCost += weight * (cost - checkpointCost);
     updateNextCheckpointTime();
+  } else if (!checkpointsEnabled()) {
+    stopTimer();
+    clearCheckpointDue();
+  } else if (getTimeInMicroseconds() >= nextCheckpointTime) {
+    // a failed or stopped checkpoint is tried again after a full interval,
+    // not at every test of the flag
+    updateNextCheckpointTime();
+  } else {
+    // the checkpoint was not due yet, the timer raises the flag again
+    clearCheckpointDue();
   }
 }
 
-std::string ACRIiLState::getNextCheckpointArgumentFileName() {
-  return std::string(getCurrentCheckpointDirectory() + "/" +
-                     std::to_string(currentCheckpointArgumentIndexCounter++));
+int64_t ACRIiLState::getNextCheckpointArgumentIndex() {
+  return currentCheckpointArgumentIndexCounter++;
 }
 
 bool ACRIiLState::performCurrentCheckpoint() {
@@ -100,25 +721,614 @@ bool ACRIiLState::performCurrentCheckpoint() {
 }
 void ACRIiLState::stopCurrentCheckpoint() { currentCheckpointEnabled = false; }
 
+uint64_t ACRIiLState::getOptimalCheckpointInterval() {
+  const double cost = checkpointCost;
+  const double mtbf = meanTimeBetweenFailures;
+  // checkpoints which take longer than the expected time to a failure cannot
+  // be amortised, just checkpoint once per MTBF
+  if (cost >= 2 * mtbf)
+    return meanTimeBetweenFailures;
+  // Daly's higher order approximation of the optimum, which is Young's
+  // sqrt(2 * cost * mtbf) for cheap checkpoints
+  const double interval =
+      sqrt(2 * cost * mtbf) *
+          (1 + sqrt(cost / (2 * mtbf)) / 3 + cost / (18 * mtbf)) -
+      cost;
+  return std::max(interval, 0.0);
+}
+
 void ACRIiLState::updateNextCheckpointTime() {
-  nextCheckpointTime = getTimeInMicroseconds() + checkpointInterval;
+  if (meanTimeBetweenFailures && checkpointCost > 0) {
+    checkpointInterval = getOptimalCheckpointInterval();
+    std::cerr << "*** ACRIiL - checkpoint cost is " << std::fixed
+              << std::setprecision(2) << checkpointCost / 1000000.0
+              << "s, next interval is "
+              << ((double)checkpointInterval) / 1000000.0 << "s ***"
+              << std::endl;
+  }
+  {
+    std::lock_guard<std::mutex> lock(timerMutex);
+    nextCheckpointTime = getTimeInMicroseconds() + checkpointInterval;
+    __atomic_store_n(&__acriilCheckpointDue,
+                     checkpointsEnabled() && checkpointInterval == 0,
+                     __ATOMIC_RELAXED);
+  }
+  // nothing has to be raised when no checkpoint will be taken
+  if (!checkpointsEnabled())
+    return;
+  startTimer();
+  timerCondition.notify_all();
+}
+
+void ACRIiLState::clearCheckpointDue() {
+  {
+    std::lock_guard<std::mutex> lock(timerMutex);
+    __atomic_store_n(&__acriilCheckpointDue, 0, __ATOMIC_RELAXED);
+  }
+  timerCondition.notify_all();
+}
+
+void ACRIiLState::startTimer() {
+  if (timerThread.joinable())
+    return;
+  timerStop = false;
+  timerThread = std::thread(&ACRIiLState::timerLoop, this);
+}
+
+void ACRIiLState::stopTimer() {
+  if (!timerThread.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(timerMutex);
+    timerStop = true;
+  }
+  timerCondition.notify_all();
+  timerThread.join();
+}
+
+void ACRIiLState::timerLoop() {
+  std::unique_lock<std::mutex> lock(timerMutex);
+  while (!timerStop) {
+    // sleep until the checkpoint is due, or until the next one is scheduled
+    if (__atomic_load_n(&__acriilCheckpointDue, __ATOMIC_RELAXED)) {
+      timerCondition.wait(lock);
+      continue;
+    }
+    const uint64_t now = getTimeInMicroseconds();
+    if (now >= nextCheckpointTime) {
+      __atomic_store_n(&__acriilCheckpointDue, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    timerCondition.wait_for(
+        lock, std::chrono::microseconds(nextCheckpointTime - now));
+  }
 }
 
-void ACRIiLState::restartSetup(std::string dir, uint64_t numVariables) {
+bool ACRIiLState::isAsyncCheckpointing() { return asyncCheckpointing; }
+
+void ACRIiLState::startWriter() {
+  if (writerThread.joinable())
+    return;
+  writerStop = false;
+  writerThread = std::thread(&ACRIiLState::writerLoop, this);
+}
+
+void ACRIiLState::stopWriter() {
+  if (!writerThread.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    writerStop = true;
+  }
+  writerCondition.notify_all();
+  writerThread.join();
+}
+
+void ACRIiLState::waitForWriter() {
+  std::unique_lock<std::mutex> lock(writerMutex);
+  writerCondition.wait(lock, [this] { return !writerJob; });
+}
+
+void ACRIiLState::enqueueCheckpoint(ACRIiLCheckpointJob *job) {
+  startWriter();
+  {
+    std::unique_lock<std::mutex> lock(writerMutex);
+    writerCondition.wait(lock, [this] { return !writerJob; });
+    writerJob = job;
+  }
+  writerCondition.notify_all();
+}
+
+void ACRIiLState::writerLoop() {
+  std::unique_lock<std::mutex> lock(writerMutex);
+  while (true) {
+    writerCondition.wait(lock, [this] { return writerJob || writerStop; });
+    // pending checkpoints are written out before stopping
+    if (!writerJob)
+      return;
+    ACRIiLCheckpointJob *job = writerJob;
+    lock.unlock();
+    bool written = __acriilWriteCheckpointJob(job);
+    if (written) {
+      std::cerr << "*** ACRIiL - checkpoint " << job->fileName
+                << " committed ***" << std::endl;
+    }
+    delete job;
+    lock.lock();
+    writerFailed |= !written;
+    writerJob = nullptr;
+    writerCondition.notify_all();
+  }
+}
+
+bool ACRIiLState::isMultiLevel() { return flushDirectory != nullptr; }
+
+std::string &ACRIiLState::getFlushDirectory() { return *flushDirectory; }
+
+std::string ACRIiLState::getLocalDirectory() {
+  const char *local = std::getenv("ACRIIL_LOCAL_DIR");
+  std::string directory = local ? local : "";
+  while (directory.size() > 1 && directory.back() == '/')
+    directory.pop_back();
+  return directory;
+}
+
+void ACRIiLState::enqueueFlush(ACRIiLFlushJob &job) {
+  if (job.checkpoint % flushEvery)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(flushMutex);
+    if (!flushThread.joinable()) {
+      flushStop = false;
+      flushThread = std::thread(&ACRIiLState::flushLoop, this);
+    }
+    flushJobs.push_back(job);
+  }
+  flushCondition.notify_all();
+}
+
+void ACRIiLState::stopFlusher() {
+  if (!flushThread.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(flushMutex);
+    flushStop = true;
+  }
+  flushCondition.notify_all();
+  flushThread.join();
+}
+
+void ACRIiLState::flushLoop() {
+  std::unique_lock<std::mutex> lock(flushMutex);
+  while (true) {
+    flushCondition.wait(lock,
+                        [this] { return !flushJobs.empty() || flushStop; });
+    // pending flushes are finished before stopping
+    if (flushJobs.empty())
+      return;
+    // the job stays queued until it is done, so the collector keeps the
+    // containers it references
+    ACRIiLFlushJob job = flushJobs.front();
+    lock.unlock();
+    // the older containers go first, so the persistent level never has a
+    // container whose references are missing
+    bool flushed = true;
+    for (uint64_t checkpoint : job.references) {
+      if (!flushed || flushedCheckpoints.count(checkpoint))
+        continue;
+      const std::string name = std::to_string(checkpoint);
+      flushed = __acriilCopyContainer(getCheckpointBaseDirectory() + name,
+                                      getFlushDirectory() + name);
+      if (flushed)
+        flushedCheckpoints.insert(checkpoint);
+    }
+    const std::string fileName =
+        getFlushDirectory() + std::to_string(job.checkpoint);
+    flushed = flushed && __acriilSyncDirectory(getFlushDirectory()) &&
+              __acriilUpdateLatestPointer(".", fileName);
+    if (flushed) {
+      std::cerr << "*** ACRIiL - checkpoint " << fileName << " flushed ***"
+                << std::endl;
+      retainCheckpoint(".", getFlushDirectory(), job.references);
+    } else {
+      std::cerr << "*** ACRIiL - Could not flush the checkpoint "
+                << fileName << " ***" << std::endl;
+    }
+    lock.lock();
+    flushJobs.pop_front();
+  }
+}
+
+void ACRIiLState::retainCheckpoint(const std::string &level,
+                                   const std::string &directory,
+                                   const std::set<uint64_t> &references) {
+  if (!keepCheckpoints)
+    return;
+  std::unique_lock<std::mutex> lock(collectorMutex);
+  std::deque<std::set<uint64_t>> &retained = retainedCheckpoints[directory];
+  retained.push_back(references);
+  if (retained.size() > keepCheckpoints)
+    retained.pop_front();
+  // the references include the checkpoint itself, which is the newest one
+  ACRIiLCollectJob job;
+  job.level = level;
+  job.directory = directory;
+  job.newest = *references.rbegin();
+  for (std::set<uint64_t> &checkpoint : retained)
+    job.retained.insert(checkpoint.begin(), checkpoint.end());
+  job.earlierEpochs = earlierEpochs[level];
+  // the containers which are still to be flushed are kept as well
+  if (isMultiLevel() && directory == getCheckpointBaseDirectory()) {
+    std::lock_guard<std::mutex> flushLock(flushMutex);
+    for (ACRIiLFlushJob &flush : flushJobs)
+      job.retained.insert(flush.references.begin(), flush.references.end());
+  }
+  if (!collectorThread.joinable()) {
+    collectorStop = false;
+    collectorThread = std::thread(&ACRIiLState::collectorLoop, this);
+  }
+  collectorJobs.push_back(job);
+  lock.unlock();
+  collectorCondition.notify_all();
+}
+
+void ACRIiLState::setEarlierEpochs(const std::string &level,
+                                   const std::vector<std::string> &epochs) {
+  if (!keepCheckpoints)
+    return;
+  std::lock_guard<std::mutex> lock(collectorMutex);
+  earlierEpochs[level] = epochs;
+}
+
+void ACRIiLState::collectedEarlierEpochs(const std::string &level) {
+  std::lock_guard<std::mutex> lock(collectorMutex);
+  earlierEpochs.erase(level);
+}
+
+void ACRIiLState::stopCollector() {
+  if (!collectorThread.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(collectorMutex);
+    collectorStop = true;
+  }
+  collectorCondition.notify_all();
+  collectorThread.join();
+}
+
+void ACRIiLState::collectorLoop() {
+  std::unique_lock<std::mutex> lock(collectorMutex);
+  while (true) {
+    collectorCondition.wait(
+        lock, [this] { return !collectorJobs.empty() || collectorStop; });
+    if (collectorJobs.empty())
+      return;
+    ACRIiLCollectJob job = collectorJobs.front();
+    collectorJobs.pop_front();
+    lock.unlock();
+    __acriilCollectCheckpoints(job);
+    lock.lock();
+  }
+}
+
+uint64_t ACRIiLState::getIOThreadCount() { return ioThreadCount; }
+
+uint64_t ACRIiLState::getCodec() { return codec; }
+
+void ACRIiLState::setIOThreadCount(uint64_t count) {
+  // the pool is started again with the new size by the next batch
+  std::lock_guard<std::mutex> batchLock(ioBatchMutex);
+  stopIOThreads();
+  ioThreadCount = count;
+}
+
+bool ACRIiLState::runIOTasks(std::vector<ACRIiLIOTask> &tasks) {
+  std::vector<std::function<bool()>> functions;
+  for (ACRIiLIOTask &task : tasks)
+    functions.push_back([&task] { return __acriilRunIOTask(task); });
+  return runTasks(functions);
+}
+
+bool ACRIiLState::runTasks(std::vector<std::function<bool()>> &tasks) {
+  // a single chunk is not worth handing over
+  if (ioThreadCount <= 1 || tasks.size() <= 1) {
+    for (std::function<bool()> &task : tasks) {
+      if (!task())
+        return false;
+    }
+    return true;
+  }
+
+  // the writer thread and the program can both transfer data, but only one
+  // batch is handed to the pool at a time
+  std::lock_guard<std::mutex> batchLock(ioBatchMutex);
+  std::unique_lock<std::mutex> lock(ioMutex);
+  ioStop = false;
+  while (ioThreads.size() + 1 < ioThreadCount)
+    ioThreads.push_back(std::thread(&ACRIiLState::ioLoop, this));
+  ioTasks = &tasks;
+  nextIOTask = 0;
+  finishedIOTasks = 0;
+  ioFailed = false;
+  ioCondition.notify_all();
+  while (runNextIOTask(lock))
+    ;
+  ioCondition.wait(lock, [this] { return finishedIOTasks == ioTasks->size(); });
+  ioTasks = nullptr;
+  return !ioFailed;
+}
+
+bool ACRIiLState::runNextIOTask(std::unique_lock<std::mutex> &lock) {
+  if (!ioTasks || nextIOTask == ioTasks->size())
+    return false;
+  std::function<bool()> &task = (*ioTasks)[nextIOTask++];
+  lock.unlock();
+  bool done = task();
+  lock.lock();
+  ioFailed |= !done;
+  if (++finishedIOTasks == ioTasks->size())
+    ioCondition.notify_all();
+  return true;
+}
+
+void ACRIiLState::ioLoop() {
+  std::unique_lock<std::mutex> lock(ioMutex);
+  while (true) {
+    ioCondition.wait(lock, [this] {
+      return ioStop || (ioTasks && nextIOTask < ioTasks->size());
+    });
+    if (ioStop)
+      return;
+    runNextIOTask(lock);
+  }
+}
+
+void ACRIiLState::stopIOThreads() {
+  {
+    std::lock_guard<std::mutex> lock(ioMutex);
+    ioStop = true;
+  }
+  ioCondition.notify_all();
+  for (std::thread &thread : ioThreads)
+    thread.join();
+  std::vector<std::thread>().swap(ioThreads);
+}
+
+bool ACRIiLState::isIncrementalCheckpointing() {
+  return incrementalCheckpointing;
+}
+
+uint64_t ACRIiLState::getPageSize() { return pageSize; }
+
+uint64_t ACRIiLState::getFullCheckpointEvery() { return fullCheckpointEvery; }
+
+bool ACRIiLState::incrementalSetup() {
+  pagemapFd = open("/proc/self/pagemap", O_RDONLY);
+  if (pagemapFd == -1)
+    return false;
+  // make sure the kernel tracks soft-dirty bits, a page which is written to
+  // after clearing them has to show up as dirty
+  char *page = (char *)mmap(NULL, pageSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED)
+    return false;
+  std::vector<bool> dirty;
+  page[0] = 1;
+  clearDirtyPages();
+  bool cleared = getDirtyPages((uintptr_t)page, pageSize, dirty) && !dirty[0];
+  page[0] = 2;
+  bool tracked = getDirtyPages((uintptr_t)page, pageSize, dirty) && dirty[0];
+  munmap(page, pageSize);
+  if (!cleared || !tracked) {
+    close(pagemapFd);
+    pagemapFd = -1;
+    return false;
+  }
+  return true;
+}
+
+bool ACRIiLState::isRecordingStats() {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  // the restart runs before the checkpoint setup, so the variable is read on
+  // first use
+  if (!statsChecked) {
+    statsChecked = true;
+    if (const char *fileName = std::getenv("ACRIIL_STATS"))
+      statsFileName = fileName;
+  }
+  return !statsFileName.empty();
+}
+
+void ACRIiLState::recordStats(const char *event, int64_t checkpoint,
+                              int64_t labelNumber, int64_t variable,
+                              uint64_t bytes, uint64_t storedBytes,
+                              uint64_t microseconds) {
+  if (!isRecordingStats())
+    return;
+  ACRIiLStatsRecord record = {event, checkpoint, labelNumber, variable,
+                              bytes, storedBytes, microseconds};
+  std::lock_guard<std::mutex> lock(statsMutex);
+  statsRecords.push_back(record);
+}
+
+static void __acriilWriteStatsField(std::ostream &out, int64_t value) {
+  // measurements which are not tied to something leave the field empty
+  if (value != -1)
+    out << value;
+  out << ",";
+}
+
+void ACRIiLState::writeStats() {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  if (statsRecords.empty())
+    return;
+  std::ofstream out(statsFileName);
+  out << "event,checkpoint,label,variable,bytes,stored_bytes,microseconds"
+      << std::endl;
+  // the variables are summed up per label at the end
+  std::map<int64_t, ACRIiLStatsRecord> labels;
+  for (ACRIiLStatsRecord &record : statsRecords) {
+    out << record.event << ",";
+    __acriilWriteStatsField(out, record.checkpoint);
+    __acriilWriteStatsField(out, record.labelNumber);
+    __acriilWriteStatsField(out, record.variable);
+    out << record.bytes << "," << record.storedBytes << ","
+        << record.microseconds << std::endl;
+    if (strcmp(record.event, "variable"))
+      continue;
+    ACRIiLStatsRecord &label = labels[record.labelNumber];
+    label.bytes += record.bytes;
+    label.storedBytes += record.storedBytes;
+    label.microseconds += record.microseconds;
+  }
+  for (std::pair<const int64_t, ACRIiLStatsRecord> &label : labels) {
+    out << "label,,";
+    __acriilWriteStatsField(out, label.first);
+    out << "," << label.second.bytes << "," << label.second.storedBytes << ","
+        << label.second.microseconds << std::endl;
+  }
+  if (!out) {
+    std::cerr << "*** ACRIiL - Could not write the statistics to "
+              << statsFileName << " ***" << std::endl;
+  }
+  std::vector<ACRIiLStatsRecord>().swap(statsRecords);
+}
+
+ACRIiLTrackedVariable *ACRIiLState::getTrackedVariable(int64_t labelNumber,
+                                                       uint64_t index) {
+  std::map<std::pair<int64_t, uint64_t>, ACRIiLTrackedVariable>::iterator it =
+      trackedVariables.find(std::make_pair(labelNumber, index));
+  if (it == trackedVariables.end())
+    return nullptr;
+  return &it->second;
+}
+
+void ACRIiLState::trackVariable(int64_t labelNumber, uint64_t index,
+                                ACRIiLTrackedVariable &variable) {
+  trackedVariables[std::make_pair(labelNumber, index)] = std::move(variable);
+}
+
+void ACRIiLState::resetTrackedVariables() { trackedVariables.clear(); }
+
+bool ACRIiLState::isDeduplicating() { return deduplicating; }
+
+// chunks of the current checkpoint are found as well, so duplicates within a
+// checkpoint are only stored once
+ACRIiLExtentEntry *ACRIiLState::findChunk(const ACRIiLChunkKey &key) {
+  std::map<ACRIiLChunkKey, ACRIiLExtentEntry>::iterator it =
+      nextChunks.find(key);
+  if (it != nextChunks.end())
+    return &it->second;
+  it = chunks.find(key);
+  if (it != chunks.end())
+    return &it->second;
+  return nullptr;
+}
+
+void ACRIiLState::addChunk(const ACRIiLChunkKey &key,
+                           const ACRIiLExtentEntry &extent) {
+  nextChunks.insert(std::make_pair(key, extent));
+}
+
+// the chunks of the checkpoint which was just handed over become the ones
+// the next checkpoint can reference
+void ACRIiLState::finishChunks() {
+  chunks.swap(nextChunks);
+  nextChunks.clear();
+}
+
+void ACRIiLState::resetChunks() {
+  chunks.clear();
+  nextChunks.clear();
+}
+
+bool ACRIiLState::getDirtyPages(uintptr_t address, uint64_t length,
+                                std::vector<bool> &dirty) {
+  // every page has a 64 bit entry in the pagemap
+  const uint64_t firstPage = address / pageSize;
+  const uint64_t lastPage = (address + length - 1) / pageSize;
+  std::vector<uint64_t> entries(lastPage - firstPage + 1);
+  if (!__acriilReadAll(pagemapFd, entries.data(),
+                       entries.size() * sizeof(uint64_t),
+                       firstPage * sizeof(uint64_t)))
+    return false;
+  dirty.resize(entries.size());
+  for (uint64_t i = 0; i < entries.size(); i++) {
+    const bool present = (entries[i] >> 63) & 1;
+    const bool swapped = (entries[i] >> 62) & 1;
+    const bool softDirty = (entries[i] >> 55) & 1;
+    // pages which are not mapped might have been discarded since the last
+    // checkpoint, so they are treated as dirty
+    dirty[i] = softDirty || !(present || swapped);
+  }
+  return true;
+}
+
+void ACRIiLState::clearDirtyPages() {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd == -1 || write(fd, "4", 1) != 1) {
+    // without clearing the bits every page would look dirty
+    incrementalCheckpointing = false;
+    resetTrackedVariables();
+  }
+  if (fd != -1)
+    close(fd);
+}
+
+void ACRIiLState::restartSetup(uint64_t numVariables) {
   restartArgumentIndexCounter = -1;
-  deleteAndNull(restartBaseDirectory);
-  restartBaseDirectory = new std::string(dir);
+  // replaces the pages of the restored buffers, which is only safe if the
+  // allocator does not expect them to be anonymous memory
+  const char *mapping = std::getenv("ACRIIL_RESTORE_MAP");
+  restoreMapping = mapping && !strcmp(mapping, "1");
+  if (restoreMapping) {
+    std::cerr << "*** ACRIiL - mapping large payloads into the restored "
+                 "buffers ***"
+              << std::endl;
+  }
+  // the restored buffers are filled in when they are first touched
+  const char *lazy = std::getenv("ACRIIL_LAZY_RESTORE");
+  if (lazy && !strcmp(lazy, "1"))
+    lazySetup();
   restartPointerAliasAddresses =
       (uint8_t **)malloc(sizeof(uint8_t **) * numVariables);
 }
 
-std::string &ACRIiLState::getRestartBaseDirectory() {
-  return *restartBaseDirectory;
+void ACRIiLState::setRestartDirectory(std::string directory) {
+  closeRestartFds();
+  deleteAndNull(restartDirectory);
+  restartDirectory = new std::string(directory);
+}
+
+std::string &ACRIiLState::getRestartDirectory() { return *restartDirectory; }
+
+int ACRIiLState::getRestartFd(uint64_t checkpoint) {
+  std::map<uint64_t, int>::iterator it = restartFds.find(checkpoint);
+  if (it != restartFds.end())
+    return it->second;
+  std::string fileName =
+      getRestartDirectory() + "/" + std::to_string(checkpoint);
+  int fd = open(fileName.c_str(), O_RDONLY);
+  restartFds[checkpoint] = fd;
+  return fd;
+}
+
+void ACRIiLState::closeRestartFds() {
+  for (std::pair<const uint64_t, int> &fd : restartFds) {
+    if (fd.second != -1)
+      close(fd.second);
+  }
+  restartFds.clear();
 }
 
-std::string ACRIiLState::getNextRestartArgumentFileName() {
-  return std::string(getRestartBaseDirectory() + "/" +
-                     std::to_string(++restartArgumentIndexCounter));
+ACRIiLVariableEntry &ACRIiLState::getNextRestartArgumentEntry() {
+  if ((uint64_t)++restartArgumentIndexCounter >= restartTable.size()) {
+    std::cerr << "*** ACRIiL - Restart has failed - too many variables - "
+                 "aborted ***"
+              << std::endl;
+    exit(-1);
+  }
+  return restartTable[restartArgumentIndexCounter];
 }
 
 void ACRIiLState::setAlias(uint8_t *ptr) {
@@ -129,8 +1339,170 @@ uint8_t *ACRIiLState::getAlias(uint64_t aliasesTo) {
   return restartPointerAliasAddresses[aliasesTo];
 }
 
+bool ACRIiLState::isRestoreMapping() { return restoreMapping; }
+
+void ACRIiLState::lazySetup() {
+  lazyFd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  struct uffdio_api api = {UFFD_API, 0, 0};
+  if (lazyFd == -1 || ioctl(lazyFd, UFFDIO_API, &api) == -1) {
+    std::cerr << "*** ACRIiL - userfaultfd is not available, the payload "
+                 "will be restored straight away ***"
+              << std::endl;
+    if (lazyFd != -1)
+      close(lazyFd);
+    lazyFd = -1;
+    return;
+  }
+  std::cerr << "*** ACRIiL - restoring large payloads lazily ***"
+            << std::endl;
+  lazyStop = false;
+  lazyRestartFinished = false;
+  lazyFailed = false;
+  lazyThread = std::thread(&ACRIiLState::lazyLoop, this);
+}
+
+bool ACRIiLState::addLazyExtent(ACRIiLLazyExtent &extent) {
+  if (lazyFd == -1)
+    return false;
+  // only anonymous memory can be registered, anything else is read now
+  struct uffdio_register range;
+  range.range.start = extent.first;
+  range.range.len = extent.last - extent.first;
+  range.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl(lazyFd, UFFDIO_REGISTER, &range) == -1)
+    return false;
+  // pages which are already there would never fault
+  if (madvise((void *)extent.first, extent.last - extent.first,
+              MADV_DONTNEED) == -1) {
+    ioctl(lazyFd, UFFDIO_UNREGISTER, &range.range);
+    return false;
+  }
+  extent.loaded = false;
+  std::lock_guard<std::mutex> lock(lazyMutex);
+  lazyExtents.push_back(extent);
+  return true;
+}
+
+bool ACRIiLState::loadLazyExtent(ACRIiLLazyExtent &extent) {
+  // the whole extent is read, so that it can be checked against its checksum
+  std::vector<char> stored(extent.storedLength);
+  if (!__acriilReadAll(extent.fd, stored.data(), extent.storedLength,
+                       extent.offset))
+    return false;
+  if (__acriilCrc32c(stored.data(), extent.storedLength) != extent.checksum) {
+    std::cerr << "*** ACRIiL - Checksum mismatch in lazily restored data at "
+                 "offset "
+              << extent.offset << " ***" << std::endl;
+    return false;
+  }
+  // copying the pages in wakes up the threads which are waiting for them
+  uint64_t copied = 0;
+  const uint64_t length = extent.last - extent.first;
+  const uint64_t inExtent = extent.first - (uintptr_t)extent.data;
+  while (copied < length) {
+    struct uffdio_copy copy;
+    copy.dst = extent.first + copied;
+    copy.src = (uintptr_t)stored.data() + inExtent + copied;
+    copy.len = length - copied;
+    copy.mode = 0;
+    copy.copy = 0;
+    if (ioctl(lazyFd, UFFDIO_COPY, &copy) == -1 && errno != EAGAIN)
+      return false;
+    if (copy.copy > 0)
+      copied += copy.copy;
+  }
+  extent.loaded = true;
+  return true;
+}
+
+void ACRIiLState::lazyLoop() {
+  uint64_t next = 0;
+  while (true) {
+    // pages which are waited for come first, the descriptor does not block
+    // and is read without the lock
+    struct uffd_msg message;
+    uintptr_t address = 0;
+    if (read(lazyFd, &message, sizeof(message)) == sizeof(message) &&
+        message.event == UFFD_EVENT_PAGEFAULT)
+      address = message.arg.pagefault.address;
+    ACRIiLLazyExtent *extent = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(lazyMutex);
+      if (lazyStop)
+        return;
+      for (ACRIiLLazyExtent &lazy : lazyExtents) {
+        if (address && !lazy.loaded && address >= lazy.first &&
+            address < lazy.last) {
+          extent = &lazy;
+          break;
+        }
+      }
+      // otherwise prefetch the extents in the order they were restored
+      while (!extent && next < lazyExtents.size()) {
+        if (!lazyExtents[next].loaded)
+          extent = &lazyExtents[next];
+        next++;
+      }
+      if (!extent && lazyRestartFinished)
+        break;
+    }
+    if (!extent) {
+      // wait for the next extent to be restored
+      struct pollfd fd = {lazyFd, POLLIN, 0};
+      poll(&fd, 1, 10);
+      continue;
+    }
+    if (!loadLazyExtent(*extent)) {
+      // restartFinish fails the restart, closing the descriptor below wakes
+      // up the threads which wait for a page
+      lazyFailed = true;
+      break;
+    }
+  }
+
+  // everything is in, the registrations go away with the descriptor
+  std::lock_guard<std::mutex> lock(lazyMutex);
+  std::deque<ACRIiLLazyExtent>().swap(lazyExtents);
+  for (std::pair<const uint64_t, int> &fd : lazyRestartFds)
+    close(fd.second);
+  lazyRestartFds.clear();
+  close(lazyFd);
+  lazyFd = -1;
+  if (!lazyFailed)
+    std::cerr << "*** ACRIiL - Lazy restore finished ***" << std::endl;
+}
+
+void ACRIiLState::stopLazyRestore() {
+  if (!lazyThread.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(lazyMutex);
+    lazyStop = true;
+  }
+  lazyThread.join();
+}
+
 void ACRIiLState::restartFinish() {
   free(restartPointerAliasAddresses);
+  if (lazyThread.joinable()) {
+    // the containers are closed once the last lazy extent is in
+    {
+      std::lock_guard<std::mutex> lock(lazyMutex);
+      lazyRestartFds.swap(restartFds);
+      lazyRestartFinished = true;
+    }
+    // every extent has to be checked against its checksum before the program
+    // goes on, so the lazy restore only overlaps with the rest of the restart
+    lazyThread.join();
+    if (lazyFailed) {
+      std::cerr << "*** ACRIiL - Restart has failed - body - aborted ***"
+                << std::endl;
+      exit(-1);
+    }
+  }
+  closeRestartFds();
+  restartExtents.clear();
+  restartTable.clear();
   std::cerr << "*** ACRIiL - Restart finished ***" << std::endl;
   updateNextCheckpointTime();
 }
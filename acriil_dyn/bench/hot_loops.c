@@ -0,0 +1,104 @@
+// Inner loop throughput of the vecadd and jacobi examples, with the loops the
+// pass checkpoints. Only the guard which loads the checkpoint due flag should
+// stay in the loop nest, the checkpoint and the restart code are called in
+// functions of their own. Both kernels are in main, as the pass only
+// checkpoints the loops of main.
+//
+// bench/hot_loops.sh builds it with the pass and fails unless main loads
+// __acriilCheckpointDue, does not call the site functions itself, and the
+// .checkpoint and .read_checkpoint blocks of main were outlined.
+// The timings are only an illustration of the cost of the guard, to compare
+// with a build without the pass:
+//   clang -O3 -o hot_loops bench/hot_loops.c -lm
+// ./hot_loops_cr [vecadd elements] [vecadd iterations] [jacobi rows]
+//   [jacobi iterations]
+// (default 1003 elements, 300000 iterations, 50 rows, 20000 iterations)
+// The default checkpoint interval is longer than the run, so only the cost of
+// the guard is measured.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double getTimeInSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, long long count, double seconds) {
+  printf("%10s %12.3f ns per element\n", name, seconds * 1e9 / count);
+}
+
+int main(int argc, char *argv[]) {
+  int N = argc > 1 ? atoi(argv[1]) : 1003;
+  int iterations = argc > 2 ? atoi(argv[2]) : 300000;
+  int rows = argc > 3 ? atoi(argv[3]) : 50;
+  int maxIterations = argc > 4 ? atoi(argv[4]) : 20000;
+
+  // vecadd
+  double a[N];
+  double b[N];
+  double c[N];
+  for (int i = 0; i < N; i++) {
+    c[i] = 0.0;
+    a[i] = 0.0015;
+    b[i] = 0.002;
+  }
+  double start = getTimeInSeconds();
+  for (int i = 0; i < iterations; i++) {
+    for (int j = 0; j < N; j++)
+      c[j] += a[j] + b[j];
+  }
+  report("vecadd", (long long)iterations * N, getTimeInSeconds() - start);
+
+  // jacobi, the threshold is never reached so that every run does the same
+  // number of iterations
+  double *A = malloc(sizeof(double) * rows * rows);
+  double *rhs = malloc(sizeof(double) * rows);
+  double *x = malloc(sizeof(double) * rows);
+  double *xtmp = malloc(sizeof(double) * rows);
+  srand(0);
+  for (int row = 0; row < rows; row++) {
+    double rowsum = 0.0;
+    for (int col = 0; col < rows; col++) {
+      double value = rand() / (double)RAND_MAX;
+      A[row + col * rows] = value;
+      rowsum += value;
+    }
+    A[row + row * rows] += rowsum;
+    rhs[row] = rand() / (double)RAND_MAX;
+    x[row] = 0.0;
+  }
+  start = getTimeInSeconds();
+  int itr = 0;
+  double sqdiff;
+  do {
+    for (int row = 0; row < rows; row++) {
+      double dot = 0.0;
+      for (int col = 0; col < rows; col++) {
+        if (row != col)
+          dot += A[row + col * rows] * x[col];
+      }
+      xtmp[row] = (rhs[row] - dot) / A[row + row * rows];
+    }
+    double *ptrtmp = x;
+    x = xtmp;
+    xtmp = ptrtmp;
+    sqdiff = 0.0;
+    for (int row = 0; row < rows; row++) {
+      double diff = xtmp[row] - x[row];
+      sqdiff += diff * diff;
+    }
+    itr++;
+  } while (itr < maxIterations && sqrt(sqdiff) >= 0.0);
+  report("jacobi", (long long)itr * rows * rows, getTimeInSeconds() - start);
+
+  // keep the results alive
+  printf("c is %lf, x is %lf\n", c[2], x[0]);
+  free(A);
+  free(rhs);
+  free(x);
+  free(xtmp);
+  return 0;
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Checks the module the pass leaves behind for bench/hot_loops.c, main only
+# loads the checkpoint due flag, the checkpoint and restart blocks are
+# outlined into functions of their own which make the site calls. The pass
+# runs last in the link time optimisation, so the precodegen module is its
+# output.
+# Run it from acriil_dyn after make cr, it exits non zero if a check fails.
+set -e
+LLVM_BIN_ROOT=${LLVM_BIN_ROOT-../../llvm-dbg/bin/}
+
+${LLVM_BIN_ROOT}clang -flto -O3 -Wl,-plugin-opt=save-temps -o hot_loops_cr \
+  bench/hot_loops.c -lm -lstdc++
+${LLVM_BIN_ROOT}llvm-dis -o hot_loops.ll hot_loops_cr.0.5.precodegen.bc
+
+awk '/^define .*@main\(/,/^}/' hot_loops.ll >hot_loops_main.ll
+if ! grep -q 'load volatile .*@__acriilCheckpointDue' hot_loops_main.ll; then
+  echo "hot_loops: main does not load the checkpoint due flag"
+  exit 1
+fi
+if grep -E '@__acriil(Checkpoint|Restart)Site\(' hot_loops_main.ll; then
+  echo "hot_loops: main calls the site functions itself"
+  exit 1
+fi
+for block in checkpoint read_checkpoint; do
+  if ! grep -qE "^define .*@main[._].*\\.$block\\(" hot_loops.ll; then
+    echo "hot_loops: no .$block block of main was outlined"
+    exit 1
+  fi
+done
+echo "hot_loops: ok"
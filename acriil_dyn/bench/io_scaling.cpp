@@ -0,0 +1,83 @@
+// Measures how checkpoint I/O scales with the number of I/O threads. A buffer
+// is split into chunks the same way the runtime splits large payloads, then
+// written to a container sized file and read back with 1, 2, 4, ... threads.
+// The write includes an fdatasync so that the device and not the page cache
+// is measured, the read is usually served from the page cache.
+//
+// g++ -std=c++11 -O3 -pthread -o io_scaling io_scaling.cpp
+// ./io_scaling [MiB] [max threads] (default 1024 MiB and all cores)
+#include "../ACRIiLState.cpp"
+#include "../checkpoint.cpp"
+#include <fcntl.h>
+#include <iomanip>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+
+#define BENCH_FILE ".acriil_bench_io_scaling"
+
+double getTimeInSeconds() { return state.getTimeInMicroseconds() / 1e6; }
+
+void report(uint64_t threads, uint64_t bytes, double writeSeconds,
+            double readSeconds) {
+  std::cout << std::setw(8) << threads << std::setw(12) << std::fixed
+            << std::setprecision(1)
+            << bytes / writeSeconds / (1024.0 * 1024.0) << std::setw(12)
+            << bytes / readSeconds / (1024.0 * 1024.0) << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  const uint64_t bytes = (argc > 1 ? atoll(argv[1]) : 1024) << 20;
+  uint64_t maxThreads = argc > 2 ? atoll(argv[2])
+                                 : std::thread::hardware_concurrency();
+  if (!maxThreads)
+    maxThreads = 1;
+  char *data = (char *)malloc(bytes);
+  char *restored = (char *)malloc(bytes);
+  for (uint64_t i = 0; i < bytes; i++)
+    data[i] = rand();
+
+  std::cout << "Buffer size " << bytes / (1024 * 1024) << " MiB, chunks of "
+            << __ACRIIL_IO_CHUNK_SIZE / (1024 * 1024) << " MiB" << std::endl;
+  std::cout << std::setw(8) << "threads" << std::setw(12) << "write MiB/s"
+            << std::setw(12) << "read MiB/s" << std::endl;
+  for (uint64_t threads = 1; threads <= maxThreads; threads *= 2) {
+    state.setIOThreadCount(threads);
+
+    int fd = open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+      std::cerr << "could not create " << BENCH_FILE << std::endl;
+      return -1;
+    }
+    std::vector<ACRIiLIOTask> tasks;
+    __acriilAddIOTasks(tasks, fd, data, bytes, 0, true);
+    double start = getTimeInSeconds();
+    if (!state.runIOTasks(tasks) || fdatasync(fd)) {
+      std::cerr << "write failed" << std::endl;
+      return -1;
+    }
+    const double writeSeconds = getTimeInSeconds() - start;
+
+    tasks.clear();
+    memset(restored, 0, bytes);
+    __acriilAddIOTasks(tasks, fd, restored, bytes, 0, false);
+    start = getTimeInSeconds();
+    if (!state.runIOTasks(tasks)) {
+      std::cerr << "read failed" << std::endl;
+      return -1;
+    }
+    const double readSeconds = getTimeInSeconds() - start;
+    close(fd);
+
+    if (memcmp(data, restored, bytes)) {
+      std::cerr << "restored data does not match" << std::endl;
+      return -1;
+    }
+    report(threads, bytes, writeSeconds, readSeconds);
+  }
+  unlink(BENCH_FILE);
+  free(data);
+  free(restored);
+  return 0;
+}
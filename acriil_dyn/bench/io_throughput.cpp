@@ -0,0 +1,110 @@
+// Compares the byte at a time iostream path the runtime used to checkpoint and
+// restart buffers with the bulk I/O path, on buffers the size of the A matrix
+// in jacobi-malloc.c.
+//
+// g++ -std=c++11 -O3 -pthread -o io_throughput io_throughput.cpp
+// ./io_throughput [N] (the buffer holds N*N doubles, default N is 4096)
+#include "../ACRIiLState.cpp"
+#include "../checkpoint.cpp"
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_FILE ".acriil_bench_io"
+
+double getTimeInSeconds() { return state.getTimeInMicroseconds() / 1e6; }
+
+void oldWrite(char *data, uint64_t totalBits) {
+  std::ofstream file;
+  file.open(BENCH_FILE, std::ios::out | std::ios::binary);
+  for (uint64_t i = 0; i < totalBits; i += 8) {
+    file.write(&data[i / 8], 1);
+  }
+  file.close();
+}
+
+void oldRead(uint8_t *data, uint64_t totalBits) {
+  std::ifstream file;
+  file.open(BENCH_FILE, std::ios::in | std::ios::binary);
+  for (uint64_t i = 0; i < totalBits; i += 8) {
+    char c;
+    if (!(file.read(&c, 1))) {
+      std::cerr << "read failed" << std::endl;
+      exit(-1);
+    }
+    if (i + 8 <= totalBits) {
+      data[i / 8] = c;
+    } else {
+      uint64_t diff = totalBits - i;
+      uint8_t mask = (~0 << diff);
+      data[i / 8] = (data[i / 8] & mask) | (c & ~mask);
+    }
+  }
+  file.close();
+}
+
+void newWrite(char *data, uint64_t totalBits) {
+  int fd = open(BENCH_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1 || !__acriilWriteAll(fd, data, (totalBits + 7) / 8, 0)) {
+    std::cerr << "write failed" << std::endl;
+    exit(-1);
+  }
+  close(fd);
+}
+
+void newRead(uint8_t *data, uint64_t totalBits) {
+  int fd = open(BENCH_FILE, O_RDONLY);
+  if (fd == -1 || !__acriilReadBits(fd, data, totalBits, 0)) {
+    std::cerr << "read failed" << std::endl;
+    exit(-1);
+  }
+  close(fd);
+}
+
+void report(const char *name, uint64_t bytes, double seconds) {
+  std::cout << std::left << std::setw(12) << name << std::right
+            << std::setw(10) << std::fixed << std::setprecision(3) << seconds
+            << " s " << std::setw(10) << std::setprecision(1)
+            << bytes / seconds / (1024.0 * 1024.0) << " MiB/s" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  const uint64_t N = argc > 1 ? atoi(argv[1]) : 4096;
+  const uint64_t bytes = sizeof(double) * N * N;
+  // use a bit width that is not a multiple of 8 for the partial byte case
+  const uint64_t totalBits = bytes * 8 - 3;
+  char *data = (char *)malloc(bytes);
+  uint8_t *restored = (uint8_t *)malloc(bytes);
+  for (uint64_t i = 0; i < bytes; i++)
+    data[i] = rand();
+
+  std::cout << "Buffer size " << bytes / (1024 * 1024) << " MiB" << std::endl;
+  double start = getTimeInSeconds();
+  oldWrite(data, totalBits);
+  report("old write", bytes, getTimeInSeconds() - start);
+  start = getTimeInSeconds();
+  oldRead(restored, totalBits);
+  report("old read", bytes, getTimeInSeconds() - start);
+
+  start = getTimeInSeconds();
+  newWrite(data, totalBits);
+  report("bulk write", bytes, getTimeInSeconds() - start);
+  memset(restored, 0, bytes);
+  start = getTimeInSeconds();
+  newRead(restored, totalBits);
+  report("bulk read", bytes, getTimeInSeconds() - start);
+
+  // the last byte only has 5 valid bits
+  if (memcmp(data, restored, bytes - 1) ||
+      (restored[bytes - 1] & 0x1f) != (data[bytes - 1] & 0x1f)) {
+    std::cerr << "restored data does not match" << std::endl;
+    return -1;
+  }
+  unlink(BENCH_FILE);
+  free(data);
+  free(restored);
+  return 0;
+}
@@ -0,0 +1,97 @@
+// Inner loops which walk pointers, to check that the pass leaves their code
+// alone. The size PHIs of a pointer PHI are only kept when a checkpoint can
+// store the pointer, so the loops in walk and scale, which no checkpoint
+// stores a pointer of, and the inner loop of main, must compile to the same
+// code with and without the pass. Only the outer loop of main, where the
+// buffers are swapped, keeps the sizes of its pointers.
+//
+// bench/size_phis.sh builds it with the pass and fails if walk or scale have
+// a .typeSizeInBits or .numElements PHI, or if main has none left for the
+// buffers it swaps. The check does not tell the inner loop of main apart from
+// the outer one, size_phis.ll shows it.
+// The timings are only an illustration, to compare with a build without the
+// pass:
+//   clang -O3 -o size_phis_plain bench/size_phis.c
+// ./size_phis [elements] [iterations] (default 1 million and 100)
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct node {
+  struct node *next;
+  double value;
+};
+
+double get_timestamp() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the loop PHI is the pointer to the current node
+__attribute__((noinline)) double walk(struct node *head) {
+  double sum = 0.0;
+  for (struct node *n = head; n; n = n->next)
+    sum += n->value;
+  return sum;
+}
+
+// the loop PHIs are the two pointers which are bumped
+__attribute__((noinline)) void scale(double *out, const double *in, int n,
+                                     double factor) {
+  const double *end = in + n;
+  while (in != end)
+    *out++ = *in++ * factor;
+}
+
+int main(int argc, char *argv[]) {
+  const int N = argc > 1 ? atoi(argv[1]) : 1000000;
+  const int ITERATIONS = argc > 2 ? atoi(argv[2]) : 100;
+  double *x = malloc(sizeof(double) * N);
+  double *y = malloc(sizeof(double) * N);
+  struct node *nodes = malloc(sizeof(struct node) * N);
+  for (int i = 0; i < N; i++) {
+    x[i] = 1.0;
+    nodes[i].value = 1.0;
+    // every node points a stride away, so the walk misses the cache, the
+    // stride is a prime, so unless N is a multiple of it all nodes are walked
+    nodes[i].next = &nodes[(i + 4099) % N];
+  }
+  nodes[(N - 1) * 4099LL % N].next = NULL;
+
+  double walkTime = 0.0;
+  double scaleTime = 0.0;
+  double copyTime = 0.0;
+  double sum = 0.0;
+  for (int itr = 0; itr < ITERATIONS; itr++) {
+    double start = get_timestamp();
+    sum += walk(nodes);
+    double end = get_timestamp();
+    walkTime += end - start;
+
+    start = end;
+    scale(y, x, N, 0.5);
+    end = get_timestamp();
+    scaleTime += end - start;
+
+    // the same in the checkpointed loop
+    start = end;
+    const double *in = y;
+    double *out = x;
+    for (int i = 0; i < N; i++)
+      *out++ = *in++ * 2.0;
+    end = get_timestamp();
+    copyTime += end - start;
+
+    double *tmp = x;
+    x = y;
+    y = tmp;
+  }
+
+  const double elements = (double)N * ITERATIONS;
+  printf("walk  %8.3lf ns per element\n", walkTime * 1e9 / elements);
+  printf("scale %8.3lf ns per element\n", scaleTime * 1e9 / elements);
+  printf("copy  %8.3lf ns per element\n", copyTime * 1e9 / elements);
+  printf("sum %lf x[0] %lf\n", sum, x[0]);
+  return 0;
+}
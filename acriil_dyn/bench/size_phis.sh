@@ -0,0 +1,24 @@
+#!/bin/sh
+# Checks the module the pass leaves behind for bench/size_phis.c, walk and
+# scale have no pointer a checkpoint stores, so they must not have size PHIs,
+# main keeps the sizes of the buffers it swaps. The pass runs last in the link
+# time optimisation, so the precodegen module is its output.
+# Run it from acriil_dyn after make cr, it exits non zero if a check fails.
+set -e
+LLVM_BIN_ROOT=${LLVM_BIN_ROOT-../../llvm-dbg/bin/}
+SIZE_PHIS='\.(typeSizeInBits|numElements)[0-9]* = phi'
+
+${LLVM_BIN_ROOT}clang -flto -O3 -Wl,-plugin-opt=save-temps -o size_phis \
+  bench/size_phis.c -lm -lstdc++
+${LLVM_BIN_ROOT}llvm-dis -o size_phis.ll size_phis.0.5.precodegen.bc
+
+if awk '/^define .*@(walk|scale)\(/,/^}/' size_phis.ll |
+  grep -E "$SIZE_PHIS"; then
+  echo "size_phis: walk or scale keeps size PHIs"
+  exit 1
+fi
+if ! awk '/^define .*@main\(/,/^}/' size_phis.ll | grep -qE "$SIZE_PHIS"; then
+  echo "size_phis: main has no size PHIs for the swapped buffers"
+  exit 1
+fi
+echo "size_phis: ok"
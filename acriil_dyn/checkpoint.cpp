@@ -1,72 +1,44 @@
 #include "checkpointRestart.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <fstream>
+#include <functional>
 #include <inttypes.h>
 #include <iostream>
+#include <limits>
+#include <limits.h>
 #include <map>
 #include <stdarg.h>
+#include <string.h>
 #include <string>
 #include <sys/stat.h>
 #include <sys/time.h>
-
-void __acriilInsertHeap(BTreeHeap *&root, BTreeHeap *leaf) {
-  if (!root) {
-    root = leaf;
-    state.heapMemory[leaf->ptr] = leaf;
-  } else if (leaf->ptr < root->ptr) {
-    __acriilInsertHeap(root->left, leaf);
-  } else {
-    __acriilInsertHeap(root->right, leaf);
-  }
-}
-
-void __acriilDumpHeapAllocs() {
-  for (auto p : state.heapMemory) {
-    std::cout << "ptr " << p.second->ptr;
-    if (p.second->left)
-      std::cout << " left " << p.second->left->ptr;
-    if (p.second->right)
-      std::cout << " right " << p.second->right->ptr;
-    std::cout << std::endl;
-  }
-  std::cout << std::endl;
-}
-
-void __acriilInsertStack(BTreeStack *&root, BTreeStack *leaf) {
-  if (!root) {
-    root = leaf;
-    state.stackMemory[leaf->ptr] = leaf;
-  } else if (leaf->ptr < root->ptr) {
-    __acriilInsertStack(root->left, leaf);
-  } else {
-    __acriilInsertStack(root->right, leaf);
-  }
-}
-
-void __acriilDumpStackAllocs() {
-  for (auto p : state.stackMemory) {
-    std::cout << "ptr " << p.second->ptr;
-    if (p.second->left)
-      std::cout << " left " << p.second->left->ptr;
-    if (p.second->right)
-      std::cout << " right " << p.second->right->ptr;
-    std::cout << std::endl;
-  }
-  std::cout << std::endl;
-}
-
-void __acriilCheckpointerAddHeapMemoryAllocation(char *ptr, uint64_t size) {
-  __acriilInsertHeap(state.heapMemoryRoot, new BTreeHeap((uintptr_t)ptr, size));
-}
-
-void __acriilCheckpointerAddStackMemoryAllocation(char *ptr, uint64_t size) {
-  __acriilInsertStack(state.stackMemoryRoot,
-                      new BTreeStack((uintptr_t)ptr, size));
-}
+#include <unistd.h>
 
 void __acriilCheckpointSetup() {
+  const uint64_t setupStart = state.getTimeInMicroseconds();
   if (!state.checkpointSetup())
     return;
 
+  // the local directory may be left over from an earlier run
+  if (state.isMultiLevel() &&
+      mkdir(state.getLocalDirectory().c_str(), 0700) == -1 &&
+      errno != EEXIST) {
+    state.permamentlyDisableCheckpointing();
+    std::cerr << "*** ACRIiL - Could not create the local directory "
+              << state.getLocalDirectory()
+              << ", checkpointing will not be performed" << std::endl;
+    return;
+  }
+
+  // the epochs of earlier runs, listed before this run adds its own
+  state.setEarlierEpochs(".", __acriilListEpochs("."));
+  if (state.isMultiLevel())
+    state.setEarlierEpochs(state.getLocalDirectory(),
+                           __acriilListEpochs(state.getLocalDirectory()));
+
   // create the checkpoint directory
   // if there are any problems, no checkpointing should be done
   struct stat st = {0};
@@ -83,136 +55,905 @@ void __acriilCheckpointSetup() {
               << std::endl;
     return;
   }
+  // and the one on the persistent level
+  if (state.isMultiLevel() &&
+      mkdir(state.getFlushDirectory().c_str(), 0700) == -1) {
+    state.permamentlyDisableCheckpointing();
+    std::cerr << "*** ACRIiL - Could not create the checkpoint directory "
+              << state.getFlushDirectory()
+              << ", checkpointing will not be performed" << std::endl;
+    return;
+  }
+  // the timer only runs once the checkpoints can be written
+  state.updateNextCheckpointTime();
+  state.recordStats("setup", -1, -1, -1, 0, 0,
+                    state.getTimeInMicroseconds() - setupStart);
 }
 
 void __acriilCheckpointStart(int64_t labelNumber,
                              int64_t numVariablesToCheckpoint) {
+  const uint64_t start = state.getTimeInMicroseconds();
   state.checkpointStart();
   if (!state.performCurrentCheckpoint())
     return;
 
   std::cerr << "*** ACRIiL - checkpoint start ***" << std::endl;
 
-  // for every checkpoint create a directory that stores all the files
-  struct stat st = {0};
+  deleteAndNull(state.checkpointJob);
+  ACRIiLCheckpointJob *job = new ACRIiLCheckpointJob();
+  state.checkpointJob = job;
+  // every checkpoint is a single container file inside the base directory
+  job->fileName = state.getCurrentCheckpointFileName();
+  // when checkpointing synchronously the payload goes straight to the file
+  if (!state.isAsyncCheckpointing()) {
+    job->fd = open(job->getTemporaryFileName().c_str(),
+                   O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (job->fd == -1) {
+      state.stopCurrentCheckpoint();
+      std::cerr << "*** ACRIiL - Could not create the checkpoint file "
+                << job->fileName << ", checkpointing will not be performed"
+                << std::endl;
+      return;
+    }
+  }
 
-  if (stat(state.getCurrentCheckpointDirectory().c_str(), &st) !=
-          -1 // check that it doesn't already exists
-      || mkdir(state.getCurrentCheckpointDirectory().c_str(), 0700) ==
-             -1) // and that we can create it
-  {
+  // set up the header, it is written out once the checkpoint finishes
+  ACRIiLContainerHeader &header = job->header;
+  header = ACRIiLContainerHeader();
+  header.version = __ACRIIL_CONTAINER_VERSION;
+  header.labelNumber = labelNumber;
+  header.numVariables = numVariablesToCheckpoint;
+  header.tableOffset = sizeof(ACRIiLContainerHeader);
+  header.checkpoint = state.getCheckpointCounter();
+  job->table.assign(numVariablesToCheckpoint, ACRIiLVariableEntry());
+  // payload starts straight after the table
+  job->payloadEnd = header.tableOffset +
+                    numVariablesToCheckpoint * sizeof(ACRIiLVariableEntry);
+  state.recordStats("start", header.checkpoint, labelNumber, -1, 0, 0,
+                    state.getTimeInMicroseconds() - start);
+}
+
+// returns the table entry for the next variable, or null if the checkpoint
+// has more variables than declared in __acriilCheckpointStart
+ACRIiLVariableEntry *__acriilCheckpointNextEntry(uint64_t elementSizeBits,
+                                                 uint64_t numElements) {
+  ACRIiLCheckpointJob *job = state.checkpointJob;
+  uint64_t index = state.getNextCheckpointArgumentIndex();
+  if (index >= job->table.size()) {
     state.stopCurrentCheckpoint();
-    std::cerr << "*** ACRIiL - Could not create the checkpoint directory "
-              << state.getCurrentCheckpointDirectory()
-              << ", checkpointing will "
-                 "not be performed"
+    std::cerr << "*** ACRIiL - Too many variables in the checkpoint, "
+                 "checkpointing will not be performed"
               << std::endl;
-    return;
+    return nullptr;
   }
-  // write the info about the checkpoint to a info file
-  std::string fileName = state.getCurrentCheckpointDirectory() + "/info";
+  ACRIiLVariableEntry &entry = job->table[index];
+  entry.index = index;
+  entry.elementSizeBits = elementSizeBits;
+  entry.numElements = numElements;
+  entry.firstExtent = job->extents.size();
+  entry.numExtents = 0;
+  return &entry;
+}
 
-  // write to a file
-  std::ofstream file;
-  file.open(fileName, std::ios::out);
-  // first write the header
-  file << labelNumber << "\n";              // label number
-  file << numVariablesToCheckpoint << "\n"; // number of live variables
-  file.close();
+// appends the parts of the extents which cover [from, to) of the variable,
+// returns false if that would cut an encoded extent
+// the data has not changed since it was stored, so the checksum of a cut
+// extent is taken from the variable
+bool __acriilCopyExtents(std::vector<ACRIiLExtentEntry> &extents,
+                         uint64_t from, uint64_t to, char *data,
+                         std::vector<ACRIiLExtentEntry> &out) {
+  for (ACRIiLExtentEntry &extent : extents) {
+    const uint64_t start = std::max(from, extent.variableOffset);
+    const uint64_t end = std::min(to, extent.variableOffset + extent.length);
+    if (start >= end)
+      continue;
+    ACRIiLExtentEntry piece = extent;
+    piece.variableOffset = start;
+    piece.length = end - start;
+    piece.offset = extent.offset + (start - extent.variableOffset);
+    piece.storedLength = piece.length;
+    if (extent.storedLength != extent.length) {
+      // encoded extents can only be referenced as a whole
+      if (piece.length != extent.length)
+        return false;
+      piece.storedLength = extent.storedLength;
+    } else if (piece.length != extent.length) {
+      piece.checksum = __acriilCrc32c(data + start, piece.length);
+    }
+    out.push_back(piece);
+  }
+  return true;
 }
 
-void __acriilCheckpointPointer(uint64_t elementSizeBits, uint64_t numElements,
-                               char *data) {
-  if (!state.performCurrentCheckpoint())
-    return;
+// splits the payload into the extents which have to be written by this
+// checkpoint and the ones that can be referenced from the previous
+// checkpoints, returns false if the whole payload has to be written
+bool __acriilIncrementalExtents(ACRIiLCheckpointJob *job,
+                                ACRIiLVariableEntry *entry, char *data,
+                                ACRIiLTrackedVariable *tracked,
+                                std::vector<ACRIiLExtentEntry> &extents) {
+  const uint64_t pageSize = state.getPageSize();
+  // small variables are cheaper to write out than to track
+  if (!tracked || entry->length < 2 * pageSize ||
+      tracked->address != (uintptr_t)data ||
+      tracked->length != entry->length || tracked->codec != entry->codec ||
+      tracked->incrementalCheckpoints + 1 >= state.getFullCheckpointEvery())
+    return false;
+
+  std::vector<bool> dirty;
+  if (!state.getDirtyPages((uintptr_t)data, entry->length, dirty))
+    return false;
+
+  // plain payloads follow the pages, encoded ones the blocks they are encoded
+  // in, which are dirty if any of their pages is
+  const uint64_t firstPageOffset = (uintptr_t)data % pageSize;
+  uint64_t blockSize = pageSize;
+  uint64_t gridOffset = firstPageOffset;
+  if (entry->codec != ACRIIL_CODEC_NONE) {
+    blockSize = __ACRIIL_CODEC_BLOCK_SIZE;
+    gridOffset = 0;
+    std::vector<bool> dirtyBlocks(
+        (entry->length + blockSize - 1) / blockSize, false);
+    for (uint64_t page = 0; page < dirty.size(); page++) {
+      if (!dirty[page])
+        continue;
+      const uint64_t from = page ? page * pageSize - firstPageOffset : 0;
+      const uint64_t to =
+          std::min(entry->length, (page + 1) * pageSize - firstPageOffset);
+      for (uint64_t block = from / blockSize; block * blockSize < to; block++)
+        dirtyBlocks[block] = true;
+    }
+    dirty.swap(dirtyBlocks);
+  }
 
-  // for the data passed in
-  // dump it to a file
-  std::string fileName = state.getNextCheckpointArgumentFileName();
+  // go over runs of blocks which are either all dirty or all clean
+  uint64_t from = 0;
+  uint64_t block = 0;
+  while (from < entry->length) {
+    uint64_t run = block;
+    while (run < dirty.size() && dirty[run] == dirty[block])
+      run++;
+    const uint64_t to = std::min(entry->length, run * blockSize - gridOffset);
+    if (dirty[block]) {
+      // the place in the container is assigned once the extent is stored
+      ACRIiLExtentEntry extent = {};
+      extent.variableOffset = from;
+      extent.length = to - from;
+      extent.checkpoint = job->header.checkpoint;
+      extents.push_back(extent);
+    } else if (!__acriilCopyExtents(tracked->extents, from, to, data,
+                                       extents)) {
+      extents.clear();
+      return false;
+    }
+    from = to;
+    block = run;
+  }
+  return true;
+}
+
+// hashes the blocks this checkpoint would store and looks them up in the
+// chunk store, found[i] is the stored chunk with the content of extents[i],
+// or the index of an earlier block of the variable with the same content
+void __acriilFindChunks(ACRIiLCheckpointJob *job, ACRIiLVariableEntry *entry,
+                        char *data, std::vector<ACRIiLExtentEntry> &extents,
+                        std::vector<ACRIiLChunkKey> &keys,
+                        std::vector<ACRIiLExtentEntry *> &found,
+                        std::vector<int64_t> &sameAs) {
+  const uint64_t checkpoint = job->header.checkpoint;
+  std::vector<std::function<bool()>> tasks;
+  for (uint64_t i = 0; i < extents.size(); i++) {
+    if (extents[i].checkpoint != checkpoint)
+      continue;
+    tasks.push_back([&, i] {
+      ACRIiLChunkKey &key = keys[i];
+      memset(&key, 0, sizeof(key));
+      __acriilHash128(data + extents[i].variableOffset, extents[i].length,
+                      key.hash);
+      key.length = extents[i].length;
+      key.codec = entry->codec;
+      if (key.codec != ACRIIL_CODEC_NONE)
+        key.elementSizeBits = entry->elementSizeBits;
+      return true;
+    });
+  }
+  const uint64_t start = state.getTimeInMicroseconds();
+  state.runTasks(tasks);
+  job->encodeMicroseconds += state.getTimeInMicroseconds() - start;
 
-  const uint64_t alias = 0;
+  // a 128 bit hash makes a collision of different chunks practically
+  // impossible, so the content is not compared
+  std::map<ACRIiLChunkKey, int64_t> first;
+  for (uint64_t i = 0; i < extents.size(); i++) {
+    if (extents[i].checkpoint != checkpoint)
+      continue;
+    job->hashedBytes += extents[i].length;
+    found[i] = state.findChunk(keys[i]);
+    if (found[i])
+      continue;
+    std::map<ACRIiLChunkKey, int64_t>::iterator it = first.find(keys[i]);
+    if (it != first.end())
+      sameAs[i] = it->second;
+    else
+      first[keys[i]] = i;
+  }
+}
 
-  // write to a file
-  std::ofstream file;
-  file.open(fileName, std::ios::out);
-  // first write the header
-  file << "alias " << alias
-       << "\n"; // indicates whether this is alias checkpoint or actual data
-  file << elementSizeBits << "\n"; // size in bits
-  file << numElements << "\n";     // num elements
+// gives the extents stored by this checkpoint their place in the container
+// and stages their payload, the payload is split into blocks which are
+// encoded and checksummed in parallel on the I/O threads
+bool __acriilStoreExtents(ACRIiLCheckpointJob *job, ACRIiLVariableEntry *entry,
+                          char *data, std::vector<ACRIiLExtentEntry> &extents) {
+  const uint64_t checkpoint = job->header.checkpoint;
+  const uint64_t codec = entry->codec;
+  const bool dedup = state.isDeduplicating();
+  uint64_t blockSize = __ACRIIL_IO_CHUNK_SIZE;
+  if (codec != ACRIIL_CODEC_NONE)
+    blockSize = __ACRIIL_CODEC_BLOCK_SIZE;
+  else if (dedup)
+    blockSize = __ACRIIL_DEDUP_CHUNK_SIZE;
+  // the blocks are aligned to the start of the variable, so the same content
+  // at the same place in another variable makes the same chunks
+  std::vector<ACRIiLExtentEntry> blocks;
+  for (ACRIiLExtentEntry &extent : extents) {
+    if (extent.checkpoint != checkpoint) {
+      blocks.push_back(extent);
+      continue;
+    }
+    const uint64_t end = extent.variableOffset + extent.length;
+    for (uint64_t from = extent.variableOffset; from < end;) {
+      const uint64_t to = std::min(end, (from / blockSize + 1) * blockSize);
+      ACRIiLExtentEntry block = extent;
+      block.variableOffset = from;
+      block.length = to - from;
+      blocks.push_back(block);
+      from = to;
+    }
+  }
+  extents.swap(blocks);
 
-  // write a separator
-  file << "\n";
+  std::vector<ACRIiLChunkKey> keys(extents.size());
+  std::vector<ACRIiLExtentEntry *> found(extents.size(), nullptr);
+  std::vector<int64_t> sameAs(extents.size(), -1);
+  if (dedup)
+    __acriilFindChunks(job, entry, data, extents, keys, found, sameAs);
+
+  std::vector<char *> encoded(extents.size(), nullptr);
+  const uint64_t start = state.getTimeInMicroseconds();
+  std::vector<std::function<bool()>> tasks;
+  for (uint64_t i = 0; i < extents.size(); i++) {
+    if (extents[i].checkpoint != checkpoint || found[i] || sameAs[i] != -1)
+      continue;
+    tasks.push_back([&, i] {
+      ACRIiLExtentEntry &extent = extents[i];
+      char *in = data + extent.variableOffset;
+      extent.storedLength = extent.length;
+      if (codec != ACRIIL_CODEC_NONE) {
+        char *out = (char *)malloc(extent.length);
+        if (!out)
+          return false;
+        const uint64_t storedLength = __acriilEncode(
+            codec, entry->elementSizeBits, in, extent.length, out);
+        // blocks which do not compress are stored as they are
+        if (storedLength) {
+          encoded[i] = in = out;
+          extent.storedLength = storedLength;
+        } else {
+          free(out);
+        }
+      }
+      extent.checksum = __acriilCrc32c(in, extent.storedLength);
+      return true;
+    });
+  }
+  const bool done = state.runTasks(tasks);
+  job->encodeMicroseconds += state.getTimeInMicroseconds() - start;
+  if (!done) {
+    for (char *out : encoded)
+      free(out);
+    return false;
+  }
+
+  for (uint64_t i = 0; i < extents.size(); i++) {
+    ACRIiLExtentEntry &extent = extents[i];
+    if (extent.checkpoint != checkpoint)
+      continue;
+    // duplicates reference the stored chunk, the variable offset stays
+    if (found[i] || sameAs[i] != -1) {
+      const ACRIiLExtentEntry &chunk =
+          found[i] ? *found[i] : extents[sameAs[i]];
+      extent.checkpoint = chunk.checkpoint;
+      extent.offset = chunk.offset;
+      extent.storedLength = chunk.storedLength;
+      extent.checksum = chunk.checksum;
+      job->dedupBytes += extent.length;
+      state.addChunk(keys[i], extent);
+      continue;
+    }
+    if (!encoded[i] && extent.length >= __ACRIIL_MAP_MIN_SIZE) {
+      // large payloads keep the offset inside a page they have in memory, so
+      // the restore can map them into a buffer with the same alignment
+      const uint64_t pageSize = state.getPageSize();
+      const uint64_t inPage =
+          (uintptr_t)(data + extent.variableOffset) % pageSize;
+      job->payloadEnd += (inPage + pageSize - job->payloadEnd % pageSize) %
+                         pageSize;
+    }
+    extent.offset = job->payloadEnd;
+    job->payloadEnd += extent.storedLength;
+    job->payloadBytes += extent.length;
+    job->storedBytes += extent.storedLength;
+    // the payloads are written together when the checkpoint finishes, so
+    // that large buffers can be split over the I/O threads
+    ACRIiLStagedPayload payload = {extent.offset, extent.storedLength,
+                                   data + extent.variableOffset, false};
+    if (encoded[i]) {
+      // the encoded copy is a snapshot already
+      payload.data = encoded[i];
+      payload.owned = true;
+    } else if (state.isAsyncCheckpointing()) {
+      // take a snapshot, the writer thread writes it out later
+      payload.data = (char *)malloc(extent.length);
+      payload.owned = true;
+      if (!payload.data) {
+        for (uint64_t j = i + 1; j < extents.size(); j++)
+          free(encoded[j]);
+        return false;
+      }
+      memcpy(payload.data, data + extent.variableOffset, extent.length);
+    }
+    job->stagedPayloads.push_back(payload);
+    if (dedup)
+      state.addChunk(keys[i], extent);
+  }
+  return true;
+}
+
+// stores the payload of a pointer, invariant payloads are only written by the
+// first checkpoint of the epoch and referenced by the following ones
+void __acriilCheckpointPayload(uint64_t elementSizeBits, uint64_t numElements,
+                               char *data, bool invariant) {
+  if (!state.performCurrentCheckpoint())
+    return;
+  const uint64_t start = state.getTimeInMicroseconds();
+
+  ACRIiLVariableEntry *entry =
+      __acriilCheckpointNextEntry(elementSizeBits, numElements);
+  if (!entry)
+    return;
+  entry->alias = 0;
+  entry->codec = state.getCodec();
 
   // body
   // dump the binary data (round to a byte size)
+  ACRIiLCheckpointJob *job = state.checkpointJob;
+  const uint64_t storedBytes = job->storedBytes;
   const uint64_t total_bits = elementSizeBits * numElements;
-  for (uint64_t i = 0; i < total_bits; i += 8) {
-    file.write(&data[i / 8], 1);
+  entry->length = (total_bits + 7) / 8;
+
+  // work out which parts of the payload this checkpoint has to store
+  ACRIiLTrackedVariable *previous =
+      state.getTrackedVariable(job->header.labelNumber, entry->index);
+  ACRIiLTrackedVariable tracked = {};
+  tracked.address = (uintptr_t)data;
+  tracked.length = entry->length;
+  tracked.codec = entry->codec;
+  if (invariant && previous && previous->address == (uintptr_t)data &&
+      previous->length == entry->length && previous->codec == entry->codec) {
+    tracked.incrementalCheckpoints = previous->incrementalCheckpoints;
+    tracked.extents = previous->extents;
+  } else if (state.isIncrementalCheckpointing() &&
+             __acriilIncrementalExtents(job, entry, data, previous,
+                                        tracked.extents)) {
+    tracked.incrementalCheckpoints = previous->incrementalCheckpoints + 1;
+  } else if (entry->length) {
+    ACRIiLExtentEntry extent = {};
+    extent.length = entry->length;
+    extent.checkpoint = job->header.checkpoint;
+    tracked.extents.push_back(extent);
+  }
+
+  if (!__acriilStoreExtents(job, entry, data, tracked.extents)) {
+    state.stopCurrentCheckpoint();
+    std::cerr << "*** ACRIiL - Could not allocate memory for the "
+                 "checkpoint, checkpointing will not be performed"
+              << std::endl;
+    return;
   }
-  file << "\n";
+  job->extents.insert(job->extents.end(), tracked.extents.begin(),
+                      tracked.extents.end());
+  entry->numExtents = tracked.extents.size();
 
-  file.close();
+  if (invariant || state.isIncrementalCheckpointing())
+    state.trackVariable(job->header.labelNumber, entry->index, tracked);
+  state.recordStats("variable", job->header.checkpoint,
+                    job->header.labelNumber, entry->index, entry->length,
+                    job->storedBytes - storedBytes,
+                    state.getTimeInMicroseconds() - start);
 }
 
-void __acriilCheckpointAlias(uint64_t numCandidates, uint64_t elementSizeBits,
-                             uint64_t numElements, char *currentPointer, ...) {
+// memory the loop overwrites before reading it only gets an entry, so the
+// restart allocates it
+void __acriilCheckpointScratch(uint64_t elementSizeBits, uint64_t numElements,
+                               char *data) {
   if (!state.performCurrentCheckpoint())
     return;
+  ACRIiLVariableEntry *entry =
+      __acriilCheckpointNextEntry(elementSizeBits, numElements);
+  if (!entry)
+    return;
+  entry->alias = 0;
+  entry->codec = state.getCodec();
+  entry->length = (elementSizeBits * numElements + 7) / 8;
+  entry->scratch = 1;
+  ACRIiLCheckpointJob *job = state.checkpointJob;
+  // nothing older can be referenced, the next checkpoint which stores the
+  // payload has to store all of it
+  if (state.isIncrementalCheckpointing()) {
+    ACRIiLTrackedVariable tracked = {};
+    tracked.address = (uintptr_t)data;
+    tracked.codec = entry->codec;
+    state.trackVariable(job->header.labelNumber, entry->index, tracked);
+  }
+  state.recordStats("scratch", job->header.checkpoint,
+                    job->header.labelNumber, entry->index, entry->length, 0,
+                    0);
+}
+
+void __acriilCheckpointPointer(uint64_t elementSizeBits, uint64_t numElements,
+                               char *data) {
+  __acriilCheckpointPayload(elementSizeBits, numElements, data, false);
+}
 
-  // for the data passed in
-  // dump it to a file
-  std::string fileName = state.getNextCheckpointArgumentFileName();
+void __acriilCheckpointInvariantPointer(uint64_t elementSizeBits,
+                                        uint64_t numElements, char *data) {
+  __acriilCheckpointPayload(elementSizeBits, numElements, data, true);
+}
 
-  va_list args;
-  va_start(args, currentPointer);
+// the candidates are given as four words each, the element size in bits, the
+// number of elements, the index of the variable and its address
+void __acriilCheckpointAliasOf(uint64_t numCandidates, uint64_t elementSizeBits,
+                               uint64_t numElements, char *currentPointer,
+                               const uint64_t *candidates) {
+  if (!state.performCurrentCheckpoint())
+    return;
+
+  ACRIiLVariableEntry *entry =
+      __acriilCheckpointNextEntry(elementSizeBits, numElements);
+  if (!entry)
+    return;
 
+  // the pointer may point into the middle of a candidate, e.g. after a GEP,
+  // then it is stored as the candidate and the offset into it. A candidate
+  // which starts exactly at the pointer is preferred, then one which contains
+  // it. The pointer may also be one past the end of a candidate, which is only
+  // used when no candidate contains it, as that address may also be the start
+  // of the next allocation
   uint64_t referanceLabel = 0;
+  uint64_t offset = 0;
   bool foundAlias = false;
-  for (uint64_t i = 0; i < numCandidates && !foundAlias; i++) {
-    uint64_t aliasElementSizeBits = va_arg(args, uint64_t);
-    uint64_t aliasNumElements = va_arg(args, uint64_t);
-    uint64_t aliasReferanceLabel = va_arg(args, uint64_t);
-    char *aliasPointerStart = va_arg(args, char(*));
+  bool pastTheEnd = false;
+  for (uint64_t i = 0; i < numCandidates; i++) {
+    const uint64_t *candidate = candidates + 4 * i;
+    const uint64_t aliasLength = (candidate[0] * candidate[1] + 7) / 8;
+    char *aliasPointerStart = (char *)(uintptr_t)candidate[3];
     if (aliasPointerStart == currentPointer) {
       foundAlias = true;
-      referanceLabel = aliasReferanceLabel;
+      pastTheEnd = false;
+      referanceLabel = candidate[2];
+      offset = 0;
+      break;
     }
+    if (currentPointer <= aliasPointerStart ||
+        currentPointer > aliasPointerStart + aliasLength)
+      continue;
+    const bool atTheEnd = currentPointer == aliasPointerStart + aliasLength;
+    if (foundAlias && (atTheEnd || !pastTheEnd))
+      continue;
+    foundAlias = true;
+    pastTheEnd = atTheEnd;
+    referanceLabel = candidate[2];
+    offset = currentPointer - aliasPointerStart;
   }
   if (!foundAlias) {
     state.stopCurrentCheckpoint();
     std::cerr << "*** ACRIiL - Could not checkpoint an alias, checkpointing "
                  "will not be performed"
               << std::endl;
+    return;
   }
   // if (foundAlias)
   //   printf("Pointer aliases the %" PRIu64 " pointer" << std::endl, ref);
+
+  // aliases have no payload, only the index of the pointer they alias
+  entry->alias = 1;
+  entry->aliasesTo = referanceLabel;
+  entry->aliasOffset = offset;
+  entry->length = 0;
+  entry->numExtents = 0;
+}
+
+void __acriilCheckpointAlias(uint64_t numCandidates, uint64_t elementSizeBits,
+                             uint64_t numElements, char *currentPointer, ...) {
+  if (!state.performCurrentCheckpoint())
+    return;
+
+  std::vector<uint64_t> candidates(4 * numCandidates);
+  va_list args;
+  va_start(args, currentPointer);
+  for (uint64_t i = 0; i < numCandidates; i++) {
+    candidates[4 * i] = va_arg(args, uint64_t);
+    candidates[4 * i + 1] = va_arg(args, uint64_t);
+    candidates[4 * i + 2] = va_arg(args, uint64_t);
+    candidates[4 * i + 3] = (uintptr_t)va_arg(args, char(*));
+  }
   va_end(args);
+  __acriilCheckpointAliasOf(numCandidates, elementSizeBits, numElements,
+                            currentPointer, candidates.data());
+}
 
-  const uint64_t alias = 1;
+void __acriilFreeStagedPayloads(ACRIiLCheckpointJob *job) {
+  for (ACRIiLStagedPayload &payload : job->stagedPayloads) {
+    if (payload.owned)
+      free(payload.data);
+  }
+  job->stagedPayloads.clear();
+}
 
-  // write to a file
-  std::ofstream file;
-  file.open(fileName, std::ios::out);
-  // first write the header
-  file << "alias " << alias
-       << "\n"; // indicates whether this is alias checkpoint or actual data
-  file << elementSizeBits << "\n"; // size in bits
-  file << numElements << "\n";     // num elements
+// makes the renames inside a directory durable
+bool __acriilSyncDirectory(std::string directory) {
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1)
+    return false;
+  bool synced = fsync(fd) == 0;
+  close(fd);
+  return synced;
+}
 
-  // write a separator
-  file << "\n";
+// points the restart straight at a committed container, the pointer is
+// replaced by a rename so it is either the previous or the new one
+bool __acriilUpdateLatestPointer(std::string directory,
+                                 std::string fileName) {
+  const std::string pointer = directory + "/" + __ACRIIL_LATEST_POINTER;
+  const std::string temporary = pointer + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  fileName += "\n";
+  bool written = fd != -1 &&
+                 __acriilWriteAll(fd, fileName.data(), fileName.size(), 0) &&
+                 fsync(fd) == 0;
+  if (fd != -1)
+    written = close(fd) == 0 && written;
+  written = written && rename(temporary.c_str(), pointer.c_str()) == 0;
+  if (!written) {
+    unlink(temporary.c_str());
+    // a stale pointer would hide this checkpoint, without one the restart
+    // scans for it
+    unlink(pointer.c_str());
+  }
+  return written && __acriilSyncDirectory(directory);
+}
 
-  // body
-  file << referanceLabel << "\n"; // write which pointer is aliased
+bool __acriilLatestPointsInto(std::string level, std::string directory) {
+  const std::string pointer = level + "/" + __ACRIIL_LATEST_POINTER;
+  int fd = open(pointer.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  char buffer[PATH_MAX] = {};
+  const ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  return length > 0 && !strncmp(buffer, directory.c_str(), directory.size());
+}
 
-  file.close();
+bool __acriilCopyContainer(std::string from, std::string to) {
+  const std::string temporary = to + ".tmp";
+  int in = open(from.c_str(), O_RDONLY);
+  int out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  struct stat st;
+  bool copied = in != -1 && out != -1 && fstat(in, &st) == 0;
+  std::vector<char> buffer;
+  for (uint64_t offset = 0; copied && offset < (uint64_t)st.st_size;
+       offset += buffer.size()) {
+    buffer.resize(
+        std::min<uint64_t>(__ACRIIL_IO_CHUNK_SIZE, st.st_size - offset));
+    copied = __acriilReadAll(in, buffer.data(), buffer.size(), offset) &&
+             __acriilWriteAll(out, buffer.data(), buffer.size(), offset);
+  }
+  copied = copied && fsync(out) == 0;
+  if (in != -1)
+    close(in);
+  if (out != -1)
+    copied = close(out) == 0 && copied;
+  copied = copied && rename(temporary.c_str(), to.c_str()) == 0;
+  if (!copied)
+    unlink(temporary.c_str());
+  return copied;
+}
+
+// deletes the regular files in an open directory which are selected, returns
+// the number of bytes freed
+static uint64_t
+__acriilUnlinkFiles(DIR *dir, std::function<bool(const char *)> selected) {
+  uint64_t freed = 0;
+  struct dirent *entry;
+  struct stat st;
+  while ((entry = readdir(dir)) != NULL) {
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        S_ISREG(st.st_mode) && selected(entry->d_name) &&
+        unlinkat(dirfd(dir), entry->d_name, 0) == 0)
+      freed += st.st_size;
+  }
+  return freed;
+}
+
+std::vector<std::string> __acriilListEpochs(std::string level) {
+  const std::string checkpointPrefix(__ACRIIL_CHECKPOINT_PREFIX);
+  std::vector<std::string> epochs;
+  if (DIR *dir = opendir(level.c_str())) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (strncmp(entry->d_name, checkpointPrefix.c_str(),
+                  checkpointPrefix.size()) ||
+          !isdigit(entry->d_name[checkpointPrefix.size()]))
+        continue;
+      std::string epoch = level == "." ? "" : level + "/";
+      epochs.push_back(epoch + entry->d_name + "/");
+    }
+    closedir(dir);
+  }
+  return epochs;
+}
+
+void __acriilCollectCheckpoints(ACRIiLCollectJob &job) {
+  const uint64_t start = state.getTimeInMicroseconds();
+  uint64_t freed = 0;
+  // the containers no retained checkpoint references, and the temporary
+  // files of checkpoints which were never committed
+  if (DIR *dir = opendir(job.directory.c_str())) {
+    freed += __acriilUnlinkFiles(dir, [&job](const char *name) {
+      char *end;
+      uint64_t checkpoint = strtoull(name, &end, 10);
+      if (end == name || checkpoint >= job.newest)
+        return false;
+      return !strcmp(end, ".tmp") ||
+             (!strcmp(end, "") && !job.retained.count(checkpoint));
+    });
+    closedir(dir);
+  }
+  // the epochs of earlier runs, which are not needed for a restart anymore
+  // once the level points at a checkpoint of this run. Neither the names nor
+  // the times of the epochs are compared, a clock step cannot make an
+  // earlier epoch look newer than this one
+  if (!job.earlierEpochs.empty() &&
+      __acriilLatestPointsInto(job.level, job.directory)) {
+    for (std::string &epoch : job.earlierEpochs) {
+      DIR *dir = opendir(epoch.c_str());
+      if (!dir)
+        continue;
+      freed += __acriilUnlinkFiles(dir, [](const char *) { return true; });
+      closedir(dir);
+      rmdir(epoch.c_str());
+    }
+    state.collectedEarlierEpochs(job.level);
+  }
+  state.recordStats("collect", -1, -1, -1, freed, 0,
+                    state.getTimeInMicroseconds() - start);
+}
+
+bool __acriilWriteCheckpointJob(ACRIiLCheckpointJob *job) {
+  const uint64_t start = state.getTimeInMicroseconds();
+  bool written = true;
+  if (job->fd == -1) {
+    job->fd = open(job->getTemporaryFileName().c_str(),
+                   O_WRONLY | O_CREAT | O_EXCL, 0600);
+    written = job->fd != -1;
+  }
+  // the payloads go to disjoint parts of the container, so the chunks can be
+  // written concurrently
+  std::vector<ACRIiLIOTask> tasks;
+  for (ACRIiLStagedPayload &payload : job->stagedPayloads) {
+    __acriilAddIOTasks(tasks, job->fd, payload.data, payload.length,
+                       payload.offset, true);
+  }
+  written = written && state.runIOTasks(tasks);
+  __acriilFreeStagedPayloads(job);
+
+  // the tables and the header go in last, only then is the container valid
+  ACRIiLContainerHeader &header = job->header;
+  header.numExtents = job->extents.size();
+  header.extentTableOffset = job->payloadEnd;
+  header.fileSize =
+      header.extentTableOffset + header.numExtents * sizeof(ACRIiLExtentEntry);
+  header.oldestCheckpoint = header.checkpoint;
+  for (ACRIiLExtentEntry &extent : job->extents)
+    header.oldestCheckpoint = std::min(header.oldestCheckpoint,
+                                       extent.checkpoint);
+  header.manifestChecksum = __acriilCrc32c(
+      job->extents.data(), header.numExtents * sizeof(ACRIiLExtentEntry),
+      __acriilCrc32c(job->table.data(),
+                     job->table.size() * sizeof(ACRIiLVariableEntry)));
+  memcpy(header.magic, __ACRIIL_CONTAINER_MAGIC, sizeof(header.magic));
+  written = written &&
+            __acriilWriteAll(job->fd, job->table.data(),
+                             job->table.size() * sizeof(ACRIiLVariableEntry),
+                             header.tableOffset) &&
+            __acriilWriteAll(job->fd, job->extents.data(),
+                             header.numExtents * sizeof(ACRIiLExtentEntry),
+                             header.extentTableOffset) &&
+            __acriilWriteAll(job->fd, &header, sizeof(header), 0);
+  // the container has to be on disk before it is renamed, otherwise a crash
+  // could leave a committed container with missing data
+  if (job->fd != -1) {
+    written = written && fsync(job->fd) == 0;
+    written = close(job->fd) == 0 && written;
+    job->fd = -1;
+  }
+  // the rename commits the checkpoint
+  written = written &&
+            rename(job->getTemporaryFileName().c_str(),
+                   job->fileName.c_str()) == 0 &&
+            __acriilSyncDirectory(state.getCheckpointBaseDirectory());
+  if (!written) {
+    unlink(job->getTemporaryFileName().c_str());
+    std::cerr << "*** ACRIiL - Could not write the checkpoint file "
+              << job->fileName << " ***" << std::endl;
+  } else {
+    const std::string level =
+        state.isMultiLevel() ? state.getLocalDirectory() : ".";
+    // the containers a restart from this checkpoint reads
+    std::set<uint64_t> references;
+    references.insert(header.checkpoint);
+    for (ACRIiLExtentEntry &extent : job->extents)
+      references.insert(extent.checkpoint);
+    if (!__acriilUpdateLatestPointer(level, job->fileName)) {
+      std::cerr << "*** ACRIiL - Could not update the latest checkpoint "
+                   "pointer ***"
+                << std::endl;
+    }
+    // the persistent level gets a copy in the background
+    if (state.isMultiLevel()) {
+      ACRIiLFlushJob flush = {header.checkpoint, references};
+      state.enqueueFlush(flush);
+    }
+    // the older checkpoints can go now that this one is durable
+    state.retainCheckpoint(level, state.getCheckpointBaseDirectory(),
+                           references);
+  }
+  state.recordStats("write", header.checkpoint, header.labelNumber, -1,
+                    job->payloadBytes, written ? header.fileSize : 0,
+                    state.getTimeInMicroseconds() - start);
+  return written;
 }
 
 void __acriilCheckpointFinish() {
+  const uint64_t start = state.getTimeInMicroseconds();
+  ACRIiLCheckpointJob *job = state.checkpointJob;
+  state.checkpointJob = nullptr;
+  const int64_t checkpoint = job ? job->header.checkpoint : -1;
+  const int64_t labelNumber = job ? job->header.labelNumber : -1;
+  const uint64_t payloadBytes = job ? job->payloadBytes : 0;
+  if (state.performCurrentCheckpoint() &&
+      state.getCodec() != ACRIIL_CODEC_NONE) {
+    const double ratio =
+        job->storedBytes ? (double)job->payloadBytes / job->storedBytes : 1;
+    const double seconds = job->encodeMicroseconds / 1e6;
+    std::cerr << "*** ACRIiL - stored " << job->storedBytes << " of "
+              << job->payloadBytes << " payload bytes, ratio " << ratio;
+    if (seconds > 0) {
+      std::cerr << ", encoded at "
+                << job->payloadBytes / seconds / (1 << 20) << " MiB/s";
+    }
+    std::cerr << " ***" << std::endl;
+  }
+  if (state.performCurrentCheckpoint() && state.isDeduplicating() &&
+      job->hashedBytes) {
+    // the ratio of the payload to the part of it which had to be stored
+    const uint64_t uniqueBytes = job->hashedBytes - job->dedupBytes;
+    const double ratio = uniqueBytes
+                             ? (double)job->hashedBytes / uniqueBytes
+                             : std::numeric_limits<double>::infinity();
+    std::cerr << "*** ACRIiL - deduplicated " << job->dedupBytes << " of "
+              << job->hashedBytes << " payload bytes, ratio " << ratio
+              << " ***" << std::endl;
+    state.recordStats("dedup", checkpoint, labelNumber, -1, job->hashedBytes,
+                      uniqueBytes, 0);
+  }
+  if (state.performCurrentCheckpoint()) {
+    if (state.isAsyncCheckpointing()) {
+      // only hand the checkpoint over, the writer thread commits it
+      state.enqueueCheckpoint(job);
+      job = nullptr;
+    } else if (!__acriilWriteCheckpointJob(job)) {
+      state.stopCurrentCheckpoint();
+      // later checkpoints must not reference the lost container
+      state.resetTrackedVariables();
+      state.resetChunks();
+    }
+    if (state.isDeduplicating())
+      state.finishChunks();
+    // the next checkpoint only has to store pages written to from now on
+    if (state.isIncrementalCheckpointing())
+      state.clearDirtyPages();
+  } else if (job) {
+    // do not leave incomplete containers behind
+    if (job->fd != -1) {
+      close(job->fd);
+      unlink(job->getTemporaryFileName().c_str());
+    }
+    __acriilFreeStagedPayloads(job);
+    state.resetTrackedVariables();
+    state.resetChunks();
+  }
+  deleteAndNull(job);
+
   state.finishCheckpoint();
 
   if (state.performCurrentCheckpoint()) {
     std::cerr << "*** ACRIiL - checkpoint finish ***" << std::endl;
+    if (checkpoint != -1) {
+      state.recordStats("finish", checkpoint, labelNumber, -1, payloadBytes,
+                        0, state.getTimeInMicroseconds() - start);
+    }
+  }
+}
+
+// true if the memory of a scratch descriptor is not overlapped by any of the
+// candidates the loop reads before overwriting it
+bool __acriilIsScratch(const uint64_t *descriptor) {
+  const uintptr_t start = descriptor[3];
+  const uintptr_t end = start + (descriptor[1] * descriptor[2] + 7) / 8;
+  for (uint64_t i = 0; i < descriptor[4]; i++) {
+    const uint64_t *candidate = descriptor + 5 + 4 * i;
+    const uintptr_t candidateStart = candidate[3];
+    const uintptr_t candidateEnd =
+        candidateStart +
+        std::max<uint64_t>((candidate[0] * candidate[1] + 7) / 8, 1);
+    if (candidateStart < end && start < candidateEnd)
+      return false;
+  }
+  return true;
+}
+
+void __acriilCheckpointSite(int64_t labelNumber, uint64_t numVariables,
+                            uint64_t *descriptors) {
+  __acriilCheckpointStart(labelNumber, numVariables);
+  uint64_t *descriptor = descriptors;
+  // the start and the length of the memory which does not have to be stored
+  std::map<uintptr_t, uint64_t> scratch;
+  uint64_t variables = 0;
+  while (variables < numVariables && state.performCurrentCheckpoint()) {
+    char *data = (char *)(uintptr_t)descriptor[3];
+    if (descriptor[0] == ACRIIL_DESCRIPTOR_SCRATCH) {
+      if (__acriilIsScratch(descriptor))
+        scratch[descriptor[3]] = (descriptor[1] * descriptor[2] + 7) / 8;
+      descriptor += 5 + 4 * descriptor[4];
+      continue;
+    }
+    switch (descriptor[0]) {
+    case ACRIIL_DESCRIPTOR_POINTER: {
+      std::map<uintptr_t, uint64_t>::iterator it =
+          scratch.find((uintptr_t)data);
+      if (it != scratch.end() &&
+          (descriptor[1] * descriptor[2] + 7) / 8 <= it->second)
+        __acriilCheckpointScratch(descriptor[1], descriptor[2], data);
+      else
+        __acriilCheckpointPayload(descriptor[1], descriptor[2], data, false);
+      break;
+    }
+    case ACRIIL_DESCRIPTOR_INVARIANT_POINTER:
+      __acriilCheckpointPayload(descriptor[1], descriptor[2], data, true);
+      break;
+    case ACRIIL_DESCRIPTOR_ALIAS:
+      __acriilCheckpointAliasOf(descriptor[4], descriptor[1], descriptor[2],
+                                data, descriptor + 5);
+      descriptor += 4 * descriptor[4];
+      break;
+    default:
+      state.stopCurrentCheckpoint();
+      std::cerr << "*** ACRIiL - Unknown descriptor " << descriptor[0]
+                << ", checkpointing will not be performed" << std::endl;
+    }
+    descriptor += 5;
+    variables++;
   }
+  __acriilCheckpointFinish();
 }
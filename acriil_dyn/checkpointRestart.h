@@ -1,100 +1,495 @@
 #ifndef CHECKPOINTRESTART_H
 #define CHECKPOINTRESTART_H
 
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
 #include <inttypes.h>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <set>
+#include <string.h>
 #include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../include/llvm/Transforms/ACRIiL/ACRIiLDescriptorKind.h"
 
 #define __ACRIIL_DEFAULT_CHECKPOINT_INTERVAL 100000000
+#define __ACRIIL_CHECKPOINT_COST_WEIGHT 0.25
+#define __ACRIIL_CHECKPOINT_PREFIX ".acriil_chkpnt-"
+#define __ACRIIL_LATEST_POINTER ".acriil_chkpnt-LATEST"
+#define __ACRIIL_CONTAINER_MAGIC "ACRIiL\0"
+#define __ACRIIL_CONTAINER_VERSION 6
+#define __ACRIIL_DEFAULT_FULL_CHECKPOINT_EVERY 8
+#define __ACRIIL_IO_CHUNK_SIZE (16ULL << 20)
+#define __ACRIIL_CODEC_BLOCK_SIZE (1ULL << 20)
+#define __ACRIIL_MAP_MIN_SIZE (1ULL << 20)
+#define __ACRIIL_DEDUP_CHUNK_SIZE (1ULL << 20)
 #define deleteAndNull(x)                                                       \
   {                                                                            \
     delete x;                                                                  \
     x = NULL;                                                                  \
   }
 
-class BTreeHeap {
-public:
-  BTreeHeap(uintptr_t ptr, uint64_t size) : ptr(ptr), size(size) {}
-  uintptr_t ptr;
-  uint64_t size;
-  BTreeHeap *left = nullptr;
-  BTreeHeap *right = nullptr;
+// Every checkpoint is stored in a single container file with the layout
+// [ACRIiLContainerHeader][ACRIiLVariableEntry * numVariables][payload]
+// [ACRIiLExtentEntry * numExtents]
+// The header is written last, so a container with a valid magic is complete.
+// The tables are the manifest of the container, they are covered by a CRC32C
+// and every extent carries the CRC32C of its stored bytes.
+struct ACRIiLContainerHeader {
+  char magic[8];
+  uint64_t version;
+  int64_t labelNumber;
+  uint64_t numVariables;
+  uint64_t tableOffset;
+  uint64_t numExtents;
+  uint64_t extentTableOffset;
+  uint64_t fileSize;
+  uint64_t checkpoint;       // number of this checkpoint in its epoch
+  uint64_t oldestCheckpoint; // oldest checkpoint payload is referenced from
+  uint64_t manifestChecksum; // CRC32C of the variable and extent tables
 };
 
-class BTreeStack {
-public:
-  BTreeStack(uintptr_t ptr, uint64_t size) : ptr(ptr), size(size) {}
-  uintptr_t ptr;
-  uint64_t size;
-  BTreeStack *left = nullptr;
-  BTreeStack *right = nullptr;
+struct ACRIiLVariableEntry {
+  uint64_t index;           // position of the variable in the checkpoint
+  uint64_t elementSizeBits; // size of a single element in bits
+  uint64_t numElements;     // number of elements
+  uint64_t alias;           // 1 if the variable only aliases another one
+  uint64_t aliasesTo;       // index of the aliased variable
+  uint64_t aliasOffset;     // byte offset of the alias into that variable
+  uint64_t length;          // length of the payload in bytes
+  uint64_t firstExtent;     // extents which make up the payload
+  uint64_t numExtents;
+  uint64_t codec;           // codec the extents were encoded with
+  uint64_t scratch;         // 1 if the payload is not stored, the loop
+                            // overwrites it before reading it
+};
+
+// codecs the payload can be encoded with, the byte shuffle groups the n-th
+// bytes of all elements together, which makes floating point data compress
+enum ACRIiLCodec : uint64_t {
+  ACRIIL_CODEC_NONE = 0,
+  ACRIIL_CODEC_SHUFFLE_RLE = 1,
+  ACRIIL_CODEC_SHUFFLE_LZ = 2,
+  ACRIIL_CODEC_COUNT
+};
+
+// A checkpoint site passes all of its variables in a single call as a table
+// of words. Checkpoint descriptors are the kind, the element size in bits,
+// the number of elements, the address and the number of alias candidates,
+// followed by four words per candidate as for __acriilCheckpointAlias.
+// Restart descriptors are the kind, the element size in bits, the number of
+// elements and the address, which receives the restored pointer of an alias.
+// Scratch descriptors come before the variables and are not counted in them,
+// they name memory the loop overwrites before reading, as long as none of the
+// candidates, which the loop reads on the way, overlaps it.
+// The kinds, ACRIiLDescriptorKind, are shared with the pass.
+
+// A contiguous piece of a variable's payload. Incremental checkpoints only
+// store the pages which changed, the rest of the payload is referenced from
+// older checkpoints in the same epoch. Stored payloads are split into extents
+// of at most __ACRIIL_IO_CHUNK_SIZE, or __ACRIIL_CODEC_BLOCK_SIZE when they
+// are encoded, so every extent is read and verified by a single task.
+struct ACRIiLExtentEntry {
+  uint64_t variableOffset; // offset of the data inside the variable
+  uint64_t length;         // length of the data in bytes
+  uint64_t checkpoint;     // checkpoint whose container holds the data
+  uint64_t offset;         // offset of the data inside that container
+  uint64_t storedLength;   // length in the container, length if not encoded
+  uint64_t checksum;       // CRC32C of the stored bytes
+};
+
+// what the previous checkpoint stored for a variable, used to only write the
+// pages which were modified since then
+struct ACRIiLTrackedVariable {
+  uintptr_t address;
+  uint64_t length;
+  uint64_t incrementalCheckpoints; // checkpoints since the last full one
+  uint64_t codec;
+  std::vector<ACRIiLExtentEntry> extents;
+};
+
+// identifies the content of a chunk, the stored form of a chunk depends on
+// the codec and, for the byte shuffle, the element size
+struct ACRIiLChunkKey {
+  uint64_t hash[2];
+  uint64_t length;
+  uint64_t codec;
+  uint64_t elementSizeBits;
+  bool operator<(const ACRIiLChunkKey &other) const {
+    return memcmp(this, &other, sizeof(*this)) < 0;
+  }
+};
+
+// payload waiting to be written to the container, asynchronous checkpoints
+// own a copy of the data, synchronous ones point into the application
+struct ACRIiLStagedPayload {
+  uint64_t offset;
+  uint64_t length;
+  char *data;
+  bool owned;
+};
+
+// a piece of a buffer transferred by one of the I/O threads
+struct ACRIiLIOTask {
+  int fd;
+  char *data;
+  uint64_t length;
+  uint64_t offset;
+  bool write;
+};
+
+// an extent whose whole pages are restored when they are first touched, the
+// rest of the extent is read straight away
+struct ACRIiLLazyExtent {
+  int fd;
+  uint64_t offset;       // offset of the extent in the container
+  uint64_t storedLength; // length of the extent in the container
+  uint64_t checksum;
+  uint8_t *data;   // where the extent is restored to
+  uintptr_t first; // pages which are registered with userfaultfd
+  uintptr_t last;
+  bool loaded;
+};
+
+// a container to copy to the persistent level, together with the older
+// containers its extents reference
+struct ACRIiLFlushJob {
+  uint64_t checkpoint;
+  std::set<uint64_t> references;
+};
+
+// containers to delete once a newer checkpoint is committed, the containers
+// of directory older than newest which are not retained, and the epochs of
+// earlier runs on level once its LATEST pointer points into directory
+struct ACRIiLCollectJob {
+  std::string level;
+  std::string directory;
+  std::set<uint64_t> retained;
+  uint64_t newest = 0;
+  std::vector<std::string> earlierEpochs;
+};
+
+// a checkpoint which is being written out
+// the container is written to a temporary file that is renamed to fileName
+// once the header is in, so a restart never sees a partial checkpoint
+struct ACRIiLCheckpointJob {
+  std::string fileName;
+  int fd = -1;
+  ACRIiLContainerHeader header;
+  std::vector<ACRIiLVariableEntry> table;
+  std::vector<ACRIiLExtentEntry> extents;
+  uint64_t payloadEnd = 0;
+  std::vector<ACRIiLStagedPayload> stagedPayloads;
+  // statistics of the payload stored by this checkpoint
+  uint64_t payloadBytes = 0;
+  uint64_t storedBytes = 0;
+  uint64_t encodeMicroseconds = 0; // includes the checksums
+  uint64_t hashedBytes = 0;        // payload looked up in the chunk store
+  uint64_t dedupBytes = 0;         // and found there
+  std::string getTemporaryFileName() { return fileName + ".tmp"; }
+};
+
+// one measurement of the instrumentation, the checkpoint and variable are -1
+// when the measurement is not tied to one
+struct ACRIiLStatsRecord {
+  const char *event;
+  int64_t checkpoint;
+  int64_t labelNumber;
+  int64_t variable;
+  uint64_t bytes;       // payload bytes
+  uint64_t storedBytes; // bytes in the container
+  uint64_t microseconds;
 };
 
 class ACRIiLState {
   // checkpoint variables
   bool checkpointing = true;
   std::string *checkpointBaseDirectory;
-  std::string *currentCheckpointDirectory;
+  std::string *currentCheckpointFileName;
   int64_t checkpointCounter = 0;
   int64_t currentCheckpointArgumentIndexCounter = 0;
   uint64_t checkpointInterval = 0;
   bool currentCheckpointEnabled = true;
   uint64_t nextCheckpointTime = 0;
 
+  // adaptive checkpoint interval, recomputed from the measured cost of the
+  // checkpoints and the mean time between failures (Young/Daly)
+  uint64_t meanTimeBetweenFailures = 0;
+  uint64_t checkpointStartTime = 0;
+  double checkpointCost = 0;
+  uint64_t getOptimalCheckpointInterval();
+
+  // the timer thread raises __acriilCheckpointDue once the next checkpoint
+  // is due, so the program only has to test a flag on its hot path
+  std::thread timerThread;
+  std::mutex timerMutex;
+  std::condition_variable timerCondition;
+  bool timerStop = false;
+  void startTimer();
+  void stopTimer();
+  void timerLoop();
+  void clearCheckpointDue();
+
+  // pool of threads which transfer and encode large buffers in chunks, the
+  // thread which hands over a batch of tasks works on it as well
+  uint64_t ioThreadCount = 1;
+  std::vector<std::thread> ioThreads;
+  std::mutex ioBatchMutex;
+  std::mutex ioMutex;
+  std::condition_variable ioCondition;
+  std::vector<std::function<bool()>> *ioTasks = nullptr;
+  uint64_t nextIOTask = 0;
+  uint64_t finishedIOTasks = 0;
+  bool ioFailed = false;
+  bool ioStop = false;
+  uint64_t codec = ACRIIL_CODEC_NONE;
+  void stopIOThreads();
+  void ioLoop();
+  bool runNextIOTask(std::unique_lock<std::mutex> &lock);
+
+  // asynchronous checkpointing, at most one checkpoint is handed over to the
+  // writer thread at a time
+  bool asyncCheckpointing = false;
+  std::thread writerThread;
+  std::mutex writerMutex;
+  std::condition_variable writerCondition;
+  ACRIiLCheckpointJob *writerJob = nullptr;
+  bool writerStop = false;
+  bool writerFailed = false;
+  void writerLoop();
+
+  uint64_t pageSize = sysconf(_SC_PAGESIZE);
+
+  // multi-level checkpointing, the checkpoints are written to a fast local
+  // directory and every flushEvery-th one is copied to the working directory
+  // by the flush thread
+  std::string localDirectory;
+  std::string *flushDirectory = nullptr;
+  uint64_t flushEvery = 1;
+  std::thread flushThread;
+  std::mutex flushMutex;
+  std::condition_variable flushCondition;
+  std::deque<ACRIiLFlushJob> flushJobs;
+  std::set<uint64_t> flushedCheckpoints;
+  bool flushStop = false;
+  void flushLoop();
+  void stopFlusher();
+
+  // checkpoint retention, the last keepCheckpoints checkpoints of each level
+  // and the containers they reference are kept, the collector thread deletes
+  // the rest
+  uint64_t keepCheckpoints = 0;
+  std::thread collectorThread;
+  std::mutex collectorMutex;
+  std::condition_variable collectorCondition;
+  std::deque<ACRIiLCollectJob> collectorJobs;
+  std::map<std::string, std::deque<std::set<uint64_t>>> retainedCheckpoints;
+  // the epochs found on each level at setup, none of them is newer than the
+  // first checkpoint this run commits there
+  std::map<std::string, std::vector<std::string>> earlierEpochs;
+  bool collectorStop = false;
+  void collectorLoop();
+  void stopCollector();
+
+  // incremental checkpointing, uses the soft-dirty bits of the page table to
+  // find out which pages were written to since the last checkpoint
+  bool incrementalCheckpointing = false;
+  uint64_t fullCheckpointEvery = __ACRIIL_DEFAULT_FULL_CHECKPOINT_EVERY;
+  int pagemapFd = -1;
+  std::map<std::pair<int64_t, uint64_t>, ACRIiLTrackedVariable>
+      trackedVariables;
+  bool incrementalSetup();
+
+  // deduplication, the chunks stored or referenced by the previous checkpoint
+  // can be referenced by the current one, which collects its own chunks for
+  // the next one. Only the previous checkpoint is used, the retention keeps
+  // its containers
+  bool deduplicating = false;
+  std::map<ACRIiLChunkKey, ACRIiLExtentEntry> chunks;
+  std::map<ACRIiLChunkKey, ACRIiLExtentEntry> nextChunks;
+
+  // instrumentation, the measurements are written to the CSV file named by
+  // ACRIIL_STATS at exit
+  std::mutex statsMutex;
+  bool statsChecked = false;
+  std::string statsFileName;
+  std::vector<ACRIiLStatsRecord> statsRecords;
+  void writeStats();
+
   // restart variables
   uint8_t **restartPointerAliasAddresses;
-  std::string *restartBaseDirectory;
+  std::string *restartDirectory;
   int64_t restartArgumentIndexCounter;
+  std::map<uint64_t, int> restartFds;
+  // map large payloads straight into the restored buffers
+  bool restoreMapping = false;
+
+  // lazy restart, the restored pages are registered with userfaultfd and
+  // filled in by a thread when they are first touched, the thread prefetches
+  // the other pages in the meantime. The restart only finishes once all of
+  // them are in and verified
+  int lazyFd = -1;
+  std::thread lazyThread;
+  std::mutex lazyMutex;
+  std::deque<ACRIiLLazyExtent> lazyExtents;
+  std::map<uint64_t, int> lazyRestartFds;
+  bool lazyRestartFinished = false;
+  bool lazyStop = false;
+  bool lazyFailed = false;
+  void lazySetup();
+  void lazyLoop();
+  bool loadLazyExtent(ACRIiLLazyExtent &extent);
+  void stopLazyRestore();
 
 public:
   ~ACRIiLState();
-  // memory
-  std::map<uintptr_t, BTreeHeap *> heapMemory;
-  BTreeHeap *heapMemoryRoot = nullptr;
-  std::map<uintptr_t, BTreeStack *> stackMemory;
-  BTreeStack *stackMemoryRoot = nullptr;
+  // checkpoint container
+  ACRIiLCheckpointJob *checkpointJob = nullptr;
+  // restart container
+  std::vector<ACRIiLVariableEntry> restartTable;
+  std::vector<ACRIiLExtentEntry> restartExtents;
   uint64_t getTimeInMicroseconds();
+  std::string getLocalDirectory();
 
   bool checkpointSetup();
   void checkpointStart();
   bool checkpointsEnabled();
   void permamentlyDisableCheckpointing();
   std::string &getCheckpointBaseDirectory();
-  std::string &getCurrentCheckpointDirectory();
-  std::string getNextCheckpointArgumentFileName();
+  std::string &getCurrentCheckpointFileName();
+  int64_t getCheckpointCounter();
+  int64_t getNextCheckpointArgumentIndex();
   bool performCurrentCheckpoint();
   void stopCurrentCheckpoint();
   void updateNextCheckpointTime();
   void finishCheckpoint();
+  bool isAsyncCheckpointing();
+  void startWriter();
+  void stopWriter();
+  void waitForWriter();
+  void enqueueCheckpoint(ACRIiLCheckpointJob *job);
+  bool isMultiLevel();
+  std::string &getFlushDirectory();
+  void enqueueFlush(ACRIiLFlushJob &job);
+  void retainCheckpoint(const std::string &level, const std::string &directory,
+                        const std::set<uint64_t> &references);
+  void setEarlierEpochs(const std::string &level,
+                        const std::vector<std::string> &epochs);
+  void collectedEarlierEpochs(const std::string &level);
+  uint64_t getIOThreadCount();
+  void setIOThreadCount(uint64_t count);
+  bool runTasks(std::vector<std::function<bool()>> &tasks);
+  bool runIOTasks(std::vector<ACRIiLIOTask> &tasks);
+  uint64_t getCodec();
+  bool isIncrementalCheckpointing();
+  uint64_t getPageSize();
+  uint64_t getFullCheckpointEvery();
+  ACRIiLTrackedVariable *getTrackedVariable(int64_t labelNumber,
+                                            uint64_t index);
+  void trackVariable(int64_t labelNumber, uint64_t index,
+                     ACRIiLTrackedVariable &variable);
+  void resetTrackedVariables();
+  bool isDeduplicating();
+  ACRIiLExtentEntry *findChunk(const ACRIiLChunkKey &key);
+  void addChunk(const ACRIiLChunkKey &key, const ACRIiLExtentEntry &extent);
+  void finishChunks();
+  void resetChunks();
+  bool getDirtyPages(uintptr_t address, uint64_t length,
+                     std::vector<bool> &dirty);
+  void clearDirtyPages();
+  bool isRecordingStats();
+  void recordStats(const char *event, int64_t checkpoint, int64_t labelNumber,
+                   int64_t variable, uint64_t bytes, uint64_t storedBytes,
+                   uint64_t microseconds);
 
-  void restartSetup(std::string dir, uint64_t numVariables);
-  std::string &getRestartBaseDirectory();
-  std::string getNextRestartArgumentFileName();
+  void restartSetup(uint64_t numVariables);
+  void setRestartDirectory(std::string directory);
+  std::string &getRestartDirectory();
+  int getRestartFd(uint64_t checkpoint);
+  void closeRestartFds();
+  ACRIiLVariableEntry &getNextRestartArgumentEntry();
   void setAlias(uint8_t *ptr);
   uint8_t *getAlias(uint64_t aliasesTo);
+  bool isRestoreMapping();
+  bool addLazyExtent(ACRIiLLazyExtent &extent);
   void restartFinish();
 };
 
-ACRIiLState state;
+extern ACRIiLState state;
+
+// bulk I/O, transfers whole buffers and retries on short reads/writes
+bool __acriilWriteAll(int fd, const void *buf, uint64_t count,
+                      uint64_t offset);
+bool __acriilReadAll(int fd, void *buf, uint64_t count, uint64_t offset);
+// reads totalBits bits into data, when totalBits is not a multiple of 8 the
+// bits in the last byte which are not part of the data are preserved
+bool __acriilReadBits(int fd, uint8_t *data, uint64_t totalBits,
+                      uint64_t offset);
+// splits a transfer into chunks for the I/O threads
+void __acriilAddIOTasks(std::vector<ACRIiLIOTask> &tasks, int fd, char *data,
+                        uint64_t length, uint64_t offset, bool write);
+bool __acriilRunIOTask(ACRIiLIOTask &task);
+// CRC32C of data, crc continues a previous checksum
+uint32_t __acriilCrc32c(const void *data, uint64_t length, uint32_t crc = 0);
+// 128 bit MurmurHash3 of data, names chunks in the chunk store
+void __acriilHash128(const void *data, uint64_t length, uint64_t hash[2]);
+
+// codecs, the encoded data has to be smaller than the input, otherwise the
+// encoder gives up and returns 0
+const char *__acriilCodecName(uint64_t codec);
+bool __acriilCodecFromName(const char *name, uint64_t &codec);
+uint64_t __acriilEncode(uint64_t codec, uint64_t elementSizeBits,
+                        const char *data, uint64_t length, char *out);
+bool __acriilDecode(uint64_t codec, uint64_t elementSizeBits, const char *in,
+                    uint64_t storedLength, char *out, uint64_t length);
+
+// writes out any staged payloads and commits the container
+bool __acriilWriteCheckpointJob(ACRIiLCheckpointJob *job);
+// points the restart of a level at a committed container
+bool __acriilUpdateLatestPointer(std::string directory, std::string fileName);
+// true if the LATEST pointer of a level names a container of directory
+bool __acriilLatestPointsInto(std::string level, std::string directory);
+bool __acriilSyncDirectory(std::string directory);
+// copies a committed container to another directory
+bool __acriilCopyContainer(std::string from, std::string to);
+// the checkpoint epoch directories of a level
+std::vector<std::string> __acriilListEpochs(std::string level);
+// deletes the checkpoints which are no longer retained
+void __acriilCollectCheckpoints(ACRIiLCollectJob &job);
+void __acriilCheckpointAliasOf(uint64_t numCandidates, uint64_t elementSizeBits,
+                               uint64_t numElements, char *currentPointer,
+                               const uint64_t *candidates);
 
 // putting extern C is a way to make sure the functions names do not get mangled
 // and that they are easy to dynamically load in LLVM
+// non zero when a checkpoint is due, the pass guards the checkpoint blocks
+// with a volatile load of this flag
+extern "C" int32_t __acriilCheckpointDue;
 // checkpoint extern functions
-extern "C" void __acriilCheckpointerAddHeapMemoryAllocation(char *ptr,
-                                                            uint64_t size);
-extern "C" void __acriilCheckpointerAddStackMemoryAllocation(char *ptr,
-                                                             uint64_t size);
 extern "C" void __acriilCheckpointSetup();
 extern "C" void __acriilCheckpointStart(int64_t labelNumber,
                                         int64_t numVariablesToCheckpoint);
 extern "C" void __acriilCheckpointPointer(uint64_t elementSizeBits,
                                           uint64_t numElements, char *data);
+// for memory the program does not write to inside the checkpointed loop
+extern "C" void __acriilCheckpointInvariantPointer(uint64_t elementSizeBits,
+                                                   uint64_t numElements,
+                                                   char *data);
 extern "C" void __acriilCheckpointAlias(uint64_t numCandidates,
                                         uint64_t elementSizeBits,
                                         uint64_t numElements,
                                         char *currentPointer, ...);
 extern "C" void __acriilCheckpointFinish();
+// checkpoints every variable of a site, see ACRIiLDescriptorKind
+extern "C" void __acriilCheckpointSite(int64_t labelNumber,
+                                       uint64_t numVariables,
+                                       uint64_t *descriptors);
 
 // restart extern functions
 extern "C" uint8_t *
@@ -104,4 +499,6 @@ extern "C" void __acriilRestartReadPointerFromCheckpoint(uint64_t sizeBits,
                                                          uint8_t *data);
 extern "C" int64_t __acriilRestartGetLabel();
 extern "C" void __acriilRestartFinish();
+extern "C" void __acriilRestartSite(uint64_t numVariables,
+                                    uint64_t *descriptors);
 #endif
@@ -1,14 +1,21 @@
 #include "checkpointRestart.h"
 #include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
+#include <functional>
 #include <inttypes.h>
 #include <iostream>
+#include <map>
 #include <set>
+#include <string.h>
 #include <string>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-std::set<std::string> __acriilGetAllFiles(std::string path) {
+// returns the names of all directories (or regular files if directories is
+// false) in path
+std::set<std::string> __acriilGetAllFiles(std::string path, bool directories) {
   char currentDir[1024];
   getcwd(currentDir, 1024);
 
@@ -26,12 +33,14 @@ std::set<std::string> __acriilGetAllFiles(std::string path) {
   chdir(path.c_str());
   while ((entry = readdir(dp)) != NULL) {
     lstat(entry->d_name, &statbuf);
-    if (S_ISDIR(statbuf.st_mode)) {
+    if (directories && S_ISDIR(statbuf.st_mode)) {
       /* Found a directory, but ignore . and .. */
       std::string fileName(entry->d_name);
       if (fileName != "." && fileName != "..") {
         fileNames.insert(fileName);
       }
+    } else if (!directories && S_ISREG(statbuf.st_mode)) {
+      fileNames.insert(std::string(entry->d_name));
     }
   }
   chdir(currentDir);
@@ -39,265 +48,469 @@ std::set<std::string> __acriilGetAllFiles(std::string path) {
   return fileNames;
 }
 
-bool __acriilCheckpointValid(int64_t &labelNumber, uint64_t &numVariables,
-                             std::string checkpointDir) {
+// reads and checks the header of the container of a checkpoint
+bool __acriilReadContainerHeader(int fd, ACRIiLContainerHeader &header) {
+  struct stat st;
+  return fd != -1 && __acriilReadAll(fd, &header, sizeof(header), 0) &&
+         fstat(fd, &st) == 0 &&
+         !memcmp(header.magic, __ACRIIL_CONTAINER_MAGIC,
+                 sizeof(header.magic)) &&
+         header.version == __ACRIIL_CONTAINER_VERSION &&
+         (uint64_t)st.st_size == header.fileSize;
+}
 
-  // open the info file which stores the info about the checkpoint
-  std::string infoFileName = checkpointDir + "/info";
-  std::ifstream infoFile;
-  infoFile.open(infoFileName, std::ios::in);
-  if (!infoFile.is_open())
-    return false;
+bool __acriilCheckpointValid(int64_t &labelNumber, uint64_t &numVariables,
+                             std::vector<ACRIiLVariableEntry> &table,
+                             std::vector<ACRIiLExtentEntry> &extents,
+                             std::string checkpointsDir, uint64_t checkpoint) {
+  // the variable table is in the container of the checkpoint itself
+  state.setRestartDirectory(checkpointsDir);
+  int fd = state.getRestartFd(checkpoint);
 
   // read the header
-  if (!(infoFile >> labelNumber >> std::ws)) // read the label number
-    return false;
-  if (!(infoFile >> numVariables >> std::ws)) // read the number of variables
+  ACRIiLContainerHeader header;
+  if (!__acriilReadContainerHeader(fd, header) ||
+      header.checkpoint != checkpoint)
     return false;
+  labelNumber = header.labelNumber;
+  numVariables = header.numVariables;
 
   std::cerr << "*** ACRIiL Label is " << labelNumber << " ***" << std::endl;
   std::cerr << "*** ACRIiL Num variables " << numVariables << " ***"
             << std::endl;
 
-  if (labelNumber < 0)
+  // the tables have to be within the container
+  const uint64_t tableSize = numVariables * sizeof(ACRIiLVariableEntry);
+  const uint64_t extentsSize = header.numExtents * sizeof(ACRIiLExtentEntry);
+  if (labelNumber < 0 || header.tableOffset + tableSize > header.fileSize ||
+      header.extentTableOffset + extentsSize > header.fileSize)
     return false;
-  infoFile.close();
-  // now verify files
-  for (uint64_t i = 0; i < numVariables; i++) {
-    std::string fileName = checkpointDir + "/" + std::to_string(i);
-    std::ifstream file;
-    file.open(fileName, std::ios::in);
-    if (!file.is_open())
-      return false;
 
-    // read the header
-    std::string aliasString;
-    uint64_t alias = 0;
-    uint64_t sizeBits = 0;
-    uint64_t numElements = 0;
+  // read the variable and extent tables
+  table.resize(numVariables);
+  extents.resize(header.numExtents);
+  if (!__acriilReadAll(fd, table.data(), tableSize, header.tableOffset) ||
+      !__acriilReadAll(fd, extents.data(), extentsSize,
+                       header.extentTableOffset) ||
+      __acriilCrc32c(extents.data(), extentsSize,
+                     __acriilCrc32c(table.data(), tableSize)) !=
+          header.manifestChecksum)
+    return false;
 
-    if (!(file >> aliasString >> alias >> std::ws) ||
-        aliasString != "alias") // read alias
-      return false;
-    if (!(file >> sizeBits >> std::ws))
-      return false;
-    if (!(file >> numElements >> std::ws))
+  // now verify that every payload is fully covered by extents which are
+  // within this or an older container, the payload itself is checked against
+  // the checksums while it is restored
+  std::map<uint64_t, uint64_t> containerSizes;
+  containerSizes[checkpoint] = header.fileSize;
+  for (uint64_t i = 0; i < numVariables; i++) {
+    ACRIiLVariableEntry &entry = table[i];
+    if (entry.index != i)
       return false;
-
-    // read the separator
-    if (!(file >> std::ws))
+    if (entry.alias) {
+      if (entry.aliasesTo >= numVariables)
+        return false;
+      continue;
+    }
+    const uint64_t totalBits = entry.elementSizeBits * entry.numElements;
+    // scratch payloads are only allocated on restart
+    if (entry.scratch) {
+      if (entry.length != (totalBits + 7) / 8 || entry.numExtents)
+        return false;
+      continue;
+    }
+    if (entry.length != (totalBits + 7) / 8 ||
+        entry.codec >= ACRIIL_CODEC_COUNT ||
+        entry.firstExtent + entry.numExtents > header.numExtents)
       return false;
-
-    if (alias) {
-      uint64_t aliasesTo;
-      if (!(file >> aliasesTo))
+    uint64_t covered = 0;
+    for (uint64_t e = 0; e < entry.numExtents; e++) {
+      ACRIiLExtentEntry &extent = extents[entry.firstExtent + e];
+      if (extent.variableOffset != covered ||
+          extent.checkpoint > checkpoint ||
+          extent.storedLength > extent.length ||
+          (entry.codec == ACRIIL_CODEC_NONE &&
+           extent.storedLength != extent.length))
         return false;
-    } else {
-      const uint64_t totalBits = sizeBits * numElements;
-      char c;
-      // read the data
-      for (uint64_t i = 0; i < totalBits; i += 8)
-        if (!(file.read(&c, 1))) // read char at a time
+      if (!containerSizes.count(extent.checkpoint)) {
+        ACRIiLContainerHeader referenced;
+        if (!__acriilReadContainerHeader(
+                state.getRestartFd(extent.checkpoint), referenced) ||
+            referenced.checkpoint != extent.checkpoint)
           return false;
+        containerSizes[extent.checkpoint] = referenced.fileSize;
+      }
+      if (extent.offset + extent.storedLength >
+          containerSizes[extent.checkpoint])
+        return false;
+      covered += extent.length;
     }
-    if (!(file >> std::ws))
+    if (covered != entry.length)
       return false;
-    if (!file.eof())
-      return false;
-    file.close();
   }
   return true;
 }
 
-int64_t __acriilRestartGetLabel() {
-  int64_t labelNumber = -1;
-  // TODO this should be in a header
-  std::string checkpointPrefix(".acriil_chkpnt-");
-  // first get all the files in current dir
-  std::set<std::string> currentDir = __acriilGetAllFiles(".");
-  std::set<uint64_t> epochs;
-  for (std::string fileName : currentDir) {
-    if (fileName.compare(0, checkpointPrefix.size(), checkpointPrefix) == 0) {
-      char *end;
-      uint64_t epoch =
-          strtoull(fileName.c_str() + checkpointPrefix.size(), &end, 10);
-      if (end != fileName.c_str() + checkpointPrefix.size()) {
-        epochs.insert(epoch);
-      }
-    }
+// validates a checkpoint and sets up the restart from it, returns false if
+// the checkpoint is not valid
+bool __acriilUseCheckpoint(std::string checkpointsDir, uint64_t checkpoint,
+                           int64_t &labelNumber) {
+  std::string checkpointFile =
+      checkpointsDir + "/" + std::to_string(checkpoint);
+  std::cerr << "*** ACRIIL - Verifying checkpoint in " << checkpointFile
+            << " ***" << std::endl;
+
+  uint64_t numVariables = 0;
+  int64_t label = 0;
+  std::vector<ACRIiLVariableEntry> table;
+  std::vector<ACRIiLExtentEntry> extents;
+  const uint64_t start = state.getTimeInMicroseconds();
+  const bool valid = __acriilCheckpointValid(label, numVariables, table,
+                                             extents, checkpointsDir,
+                                             checkpoint);
+  state.recordStats("validate", checkpoint, valid ? label : -1, -1, 0, 0,
+                    state.getTimeInMicroseconds() - start);
+  if (!valid) {
+    state.closeRestartFds();
+    return false;
   }
-  bool foundValidCheckpoint = false;
-  // iterate over epochs from most recent to find the most recent valid
-  // checkpoint
-  for (std::set<uint64_t>::reverse_iterator rit = epochs.rbegin();
-       rit != epochs.rend() && !foundValidCheckpoint; rit++) {
-    std::string checkpointsDir = checkpointPrefix + std::to_string(*rit);
+  std::cerr << "*** ACRIiL - Using checkpoint with label " << label << " ***"
+            << std::endl;
+  labelNumber = label;
+  // keep the containers open, variables are read from them by offset
+  state.restartSetup(numVariables);
+  state.restartTable.swap(table);
+  state.restartExtents.swap(extents);
+  return true;
+}
+
+// the directory holding the checkpoints of an epoch on a level
+std::string __acriilEpochDirectory(const std::string &level, uint64_t epoch) {
+  const std::string name = __ACRIIL_CHECKPOINT_PREFIX + std::to_string(epoch);
+  return level == "." ? name : level + "/" + name;
+}
+
+// a checkpoint the restart can be done from, level 0 is the fastest one
+struct ACRIiLRestartCandidate {
+  uint64_t epoch;
+  uint64_t checkpoint;
+  size_t level;
+  bool operator<(const ACRIiLRestartCandidate &other) const {
+    // the most recent first, if it is on several levels the fastest first
+    if (epoch != other.epoch)
+      return epoch > other.epoch;
+    if (checkpoint != other.checkpoint)
+      return checkpoint > other.checkpoint;
+    return level < other.level;
+  }
+};
+
+// reads the pointer to the last committed checkpoint of a level
+bool __acriilReadLatestPointer(const std::vector<std::string> &levels,
+                               size_t level,
+                               ACRIiLRestartCandidate &candidate) {
+  std::ifstream in(levels[level] + "/" + __ACRIIL_LATEST_POINTER);
+  std::string fileName;
+  if (!std::getline(in, fileName))
+    return false;
+  const size_t slash = fileName.rfind('/');
+  if (slash == std::string::npos || slash == 0)
+    return false;
+  const char *number = fileName.c_str() + slash + 1;
+  char *end;
+  candidate.checkpoint = strtoull(number, &end, 10);
+  if (end == number || *end != '\0')
+    return false;
+  const std::string checkpointPrefix(__ACRIIL_CHECKPOINT_PREFIX);
+  const size_t epochDir = fileName.rfind('/', slash - 1) + 1;
+  if (fileName.compare(epochDir, checkpointPrefix.size(), checkpointPrefix))
+    return false;
+  candidate.epoch =
+      strtoull(fileName.c_str() + epochDir + checkpointPrefix.size(), &end, 10);
+  candidate.level = level;
+  // the pointer has to name a container on its own level
+  return fileName.substr(0, slash) ==
+         __acriilEpochDirectory(levels[level], candidate.epoch);
+}
+
+// adds all checkpoints stored on a level
+void __acriilScanLevel(const std::vector<std::string> &levels, size_t level,
+                       std::set<ACRIiLRestartCandidate> &candidates) {
+  std::string checkpointPrefix(__ACRIIL_CHECKPOINT_PREFIX);
+  std::set<std::string> levelDir = __acriilGetAllFiles(levels[level], true);
+  for (std::string fileName : levelDir) {
+    if (fileName.compare(0, checkpointPrefix.size(), checkpointPrefix) != 0)
+      continue;
+    char *end;
+    uint64_t epoch =
+        strtoull(fileName.c_str() + checkpointPrefix.size(), &end, 10);
+    if (end == fileName.c_str() + checkpointPrefix.size())
+      continue;
+    std::string checkpointsDir = __acriilEpochDirectory(levels[level], epoch);
     std::cerr << "*** ACRIIL - Looking for checkpoints in " << checkpointsDir
               << " ***" << std::endl;
-    std::set<std::string> checkpointDirs = __acriilGetAllFiles(checkpointsDir);
-    std::set<uint64_t> checkpoints;
-    for (std::string fileName : checkpointDirs) {
-      char *end;
+    std::set<std::string> checkpointFiles =
+        __acriilGetAllFiles(checkpointsDir, false);
+    for (std::string fileName : checkpointFiles) {
       uint64_t checkpoint = strtoull(fileName.c_str(), &end, 10);
-      if (end != fileName.c_str()) {
-        checkpoints.insert(checkpoint);
-      }
-    }
-
-    // iterate over checkpoints
-    for (std::set<uint64_t>::reverse_iterator rit = checkpoints.rbegin();
-         rit != checkpoints.rend() && !foundValidCheckpoint; rit++) {
-      std::string checkpointDir = checkpointsDir + "/" + std::to_string(*rit);
-      std::cerr << "*** ACRIIL - Verifying checkpoint in " << checkpointDir
-                << " ***" << std::endl;
-
-      uint64_t numVariables = 0;
-      int64_t label = 0;
-      if (__acriilCheckpointValid(label, numVariables, checkpointDir)) {
-        std::cerr << "*** ACRIiL - Using checkpoint with label " << label
-                  << " ***" << std::endl;
-        labelNumber = label;
-        state.restartSetup(checkpointDir, numVariables);
-        foundValidCheckpoint = true;
-      } else {
-        std::cerr
-            << "*** ACRIiL - Checkpoint invalid, trying an older version. ***"
-            << std::endl;
-      }
+      if (end != fileName.c_str() && *end == '\0')
+        candidates.insert({epoch, checkpoint, level});
     }
   }
-  return labelNumber;
 }
 
-void __acriilRestartReadPointerFromCheckpoint(uint64_t sizeBits,
-                                              uint64_t numElements,
-                                              uint8_t *data) {
-  std::string fileName = state.getNextRestartArgumentFileName();
-  std::ifstream file;
-  file.open(fileName, std::ios::in);
-  if (!file.is_open())
-    exit(-1);
+int64_t __acriilRestartGetLabel() {
+  int64_t labelNumber = -1;
+  // the checkpoint levels, the fastest first
+  std::vector<std::string> levels;
+  const std::string localDirectory = state.getLocalDirectory();
+  if (!localDirectory.empty())
+    levels.push_back(localDirectory);
+  levels.push_back(".");
 
-  // read the header
-  std::string aliasString;
-  uint64_t aliasFromFile = 0;
-  uint64_t sizeBitsFromFile = 0;
-  uint64_t numElementsFromFile = 0;
+  // the pointers name the last committed checkpoints, so the directories only
+  // have to be scanned if they are missing or the checkpoints are not valid
+  std::set<ACRIiLRestartCandidate> latest;
+  for (size_t level = 0; level < levels.size(); level++) {
+    ACRIiLRestartCandidate candidate;
+    if (__acriilReadLatestPointer(levels, level, candidate))
+      latest.insert(candidate);
+  }
+  for (const ACRIiLRestartCandidate &candidate : latest) {
+    if (__acriilUseCheckpoint(
+            __acriilEpochDirectory(levels[candidate.level], candidate.epoch),
+            candidate.checkpoint, labelNumber))
+      return labelNumber;
+    std::cerr << "*** ACRIiL - Latest checkpoint invalid, looking for an "
+                 "older version. ***"
+              << std::endl;
+  }
+
+  std::set<ACRIiLRestartCandidate> candidates;
+  for (size_t level = 0; level < levels.size(); level++)
+    __acriilScanLevel(levels, level, candidates);
+  // iterate from the most recent to find the most recent valid checkpoint
+  for (const ACRIiLRestartCandidate &candidate : candidates) {
+    // the latest checkpoints were already tried
+    if (latest.count(candidate))
+      continue;
+    if (__acriilUseCheckpoint(
+            __acriilEpochDirectory(levels[candidate.level], candidate.epoch),
+            candidate.checkpoint, labelNumber))
+      break;
+    std::cerr
+        << "*** ACRIiL - Checkpoint invalid, trying an older version. ***"
+        << std::endl;
+  }
+  return labelNumber;
+}
 
-  if (!(file >> aliasString >> aliasFromFile >> std::ws) ||
-      aliasString != "alias" || aliasFromFile != 0) { // read alias
+// returns the table entry for the next variable to restore, after checking
+// that it was written for a variable of the same kind, type and size
+ACRIiLVariableEntry &__acriilRestartNextEntry(uint64_t alias,
+                                              uint64_t sizeBits,
+                                              uint64_t numElements) {
+  ACRIiLVariableEntry &entry = state.getNextRestartArgumentEntry();
+  if (entry.alias != alias) {
     std::cerr << "*** ACRIiL - Restart has failed - header(alias) - aborted ***"
               << std::endl;
     exit(-1);
   }
-  if (!(file >> sizeBitsFromFile >> std::ws)) { // read sizebits
+  if (entry.elementSizeBits != sizeBits) {
     std::cerr
         << "*** ACRIiL - Restart has failed - header(sizeBits) - aborted ***"
         << std::endl;
     exit(-1);
   }
-  if (!(file >> numElementsFromFile >> std::ws)) { // read numElements
+  if (entry.numElements != numElements) {
     std::cerr
         << "*** ACRIiL - Restart has failed - header(numElements) - aborted ***"
         << std::endl;
     exit(-1);
   }
+  return entry;
+}
 
-  // read the separator
-  if (!(file >> std::ws)) {
-    std::cerr << "*** ACRIiL - Restart has failed - separator - aborted ***"
-              << std::endl;
-    exit(-1);
-  }
+bool __acriilVerifyExtent(ACRIiLExtentEntry &extent, uint32_t checksum) {
+  if (checksum == extent.checksum)
+    return true;
+  std::cerr << "*** ACRIiL - Checksum mismatch in checkpoint "
+            << extent.checkpoint << " at offset " << extent.offset << " ***"
+            << std::endl;
+  return false;
+}
 
-  // read the data
-  const uint64_t totalBits = sizeBits * numElements;
-  for (uint64_t i = 0; i < totalBits; i += 8) {
-    char c;
-    if (!(file.read(&c, 1))) // read char at a time
-    {
-      std::cerr << "*** ACRIiL - Restart has failed - body - aborted ***"
-                << std::endl;
-      exit(-1);
-    }
-    // make sure to not overwrite other data when writing less than a byte
-    if (i + 8 <= totalBits) {
-      data[i / 8] = c;
-    } else {
-      uint64_t diff = totalBits - i;
-      uint8_t mask = (~0 << diff);
-      data[i / 8] = (data[i / 8] & mask) | (c & ~mask);
+// reads length bytes of the container at offset into out, large payloads are
+// mapped and copied, or mapped straight into out when it has the same offset
+// inside a page as the payload in the container
+bool __acriilReadPayload(int fd, uint8_t *out, uint64_t length,
+                         uint64_t offset) {
+  if (length < __ACRIIL_MAP_MIN_SIZE)
+    return __acriilReadAll(fd, out, length, offset);
+
+  const uint64_t pageSize = state.getPageSize();
+  if (state.isRestoreMapping() && ((uintptr_t)out - offset) % pageSize == 0) {
+    // only whole pages can be mapped, the ends are read
+    const uintptr_t first =
+        ((uintptr_t)out + pageSize - 1) / pageSize * pageSize;
+    const uintptr_t last = ((uintptr_t)out + length) / pageSize * pageSize;
+    const uint64_t head = first - (uintptr_t)out;
+    if (mmap((void *)first, last - first, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, offset + head) != MAP_FAILED) {
+      return __acriilReadAll(fd, out, head, offset) &&
+             __acriilReadAll(fd, (uint8_t *)last,
+                             (uintptr_t)out + length - last,
+                             offset + (last - (uintptr_t)out));
     }
   }
 
-  if (!(file >> std::ws)) {
-    std::cerr << "*** ACRIiL - Restart has failed - EOF - aborted ***"
-              << std::endl;
-    exit(-1);
-  }
-  file.close();
-  state.setAlias(data);
+  const uint64_t mapOffset = offset / pageSize * pageSize;
+  const uint64_t mapLength = offset + length - mapOffset;
+  void *map = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fd, mapOffset);
+  if (map == MAP_FAILED)
+    return __acriilReadAll(fd, out, length, offset);
+  madvise(map, mapLength, MADV_SEQUENTIAL);
+  memcpy(out, (char *)map + (offset - mapOffset), length);
+  munmap(map, mapLength);
+  return true;
 }
 
-uint8_t *__acriilRestartReadAliasFromCheckpoint(uint64_t sizeBits,
-                                                uint64_t numElements) {
-  std::string fileName = state.getNextRestartArgumentFileName();
-  std::ifstream file;
-  file.open(fileName, std::ios::in);
-  if (!file.is_open())
-    exit(-1);
+// hands the whole pages of an extent over to the lazy restore and reads the
+// rest, returns false if the extent has to be read straight away. The lazy
+// restore checks the whole extent, these bytes included, against its checksum
+// before the restart finishes
+bool __acriilReadLazyExtent(ACRIiLExtentEntry &extent, int fd, uint8_t *out,
+                            uint64_t length) {
+  const uint64_t pageSize = state.getPageSize();
+  ACRIiLLazyExtent lazy;
+  lazy.fd = fd;
+  lazy.offset = extent.offset;
+  lazy.storedLength = extent.storedLength;
+  lazy.checksum = extent.checksum;
+  lazy.data = out;
+  lazy.first = ((uintptr_t)out + pageSize - 1) / pageSize * pageSize;
+  lazy.last = ((uintptr_t)out + length) / pageSize * pageSize;
+  if (lazy.first >= lazy.last || !state.addLazyExtent(lazy))
+    return false;
+  const uint64_t head = lazy.first - (uintptr_t)out;
+  return __acriilReadAll(fd, out, head, extent.offset) &&
+         __acriilReadAll(fd, (uint8_t *)lazy.last,
+                         (uintptr_t)out + length - lazy.last,
+                         extent.offset + (lazy.last - (uintptr_t)out));
+}
 
-  // read the header
-  std::string aliasString;
-  uint64_t aliasFromFile = 0;
-  uint64_t sizeBitsFromFile = 0;
-  uint64_t numElementsFromFile = 0;
-  uint64_t aliasesTo;
-
-  if (!(file >> aliasString >> aliasFromFile >> std::ws) ||
-      aliasString != "alias" || aliasFromFile != 1) { // read alias
-    std::cerr << "*** ACRIiL - Restart has failed - header(alias) - aborted ***"
-              << std::endl;
-    exit(-1);
-  }
-  if (!(file >> sizeBitsFromFile >> std::ws)) { // read sizebits
-    std::cerr
-        << "*** ACRIiL - Restart has failed - header(sizeBits) - aborted ***"
-        << std::endl;
-    exit(-1);
-  }
-  if (!(file >> numElementsFromFile >> std::ws)) { // read numElements
-    std::cerr
-        << "*** ACRIiL - Restart has failed - header(numElements) - aborted ***"
-        << std::endl;
-    exit(-1);
+// reads an extent which is not encoded into the variable
+bool __acriilReadRawExtent(ACRIiLExtentEntry &extent, int fd, uint8_t *data,
+                           uint64_t totalBits) {
+  const uint64_t fullBytes = totalBits / 8;
+  uint64_t length = extent.length;
+  // only the last extent can end in a partial byte, which must not
+  // overwrite the rest of that byte
+  const bool partial = extent.variableOffset + length > fullBytes;
+  if (partial)
+    length = fullBytes - extent.variableOffset;
+  uint8_t *out = data + extent.variableOffset;
+  uint8_t lastByte;
+  if (length >= __ACRIIL_MAP_MIN_SIZE &&
+      __acriilReadLazyExtent(extent, fd, out, length))
+    return !partial || __acriilReadBits(fd, out + length, totalBits % 8,
+                                        extent.offset + length);
+  if (!__acriilReadPayload(fd, out, length, extent.offset) ||
+      (partial && !__acriilReadAll(fd, &lastByte, 1, extent.offset + length)))
+    return false;
+  uint32_t checksum = __acriilCrc32c(out, length);
+  if (partial) {
+    checksum = __acriilCrc32c(&lastByte, 1, checksum);
+    const uint8_t keep = (uint8_t)(0xff << (totalBits % 8));
+    data[fullBytes] = (data[fullBytes] & keep) | (lastByte & ~keep);
   }
+  return __acriilVerifyExtent(extent, checksum);
+}
 
-  // read the separator
-  if (!(file >> std::ws)) {
-    std::cerr << "*** ACRIiL - Restart has failed - separator - aborted ***"
-              << std::endl;
-    exit(-1);
+// reads an encoded extent and decodes it into the variable
+bool __acriilReadEncodedExtent(ACRIiLVariableEntry &entry,
+                               ACRIiLExtentEntry &extent, int fd,
+                               uint8_t *data, uint64_t totalBits) {
+  std::vector<char> stored(extent.storedLength);
+  std::vector<char> decoded(extent.length);
+  if (!__acriilReadAll(fd, stored.data(), extent.storedLength,
+                       extent.offset) ||
+      !__acriilVerifyExtent(extent, __acriilCrc32c(stored.data(),
+                                                   extent.storedLength)) ||
+      !__acriilDecode(entry.codec, entry.elementSizeBits, stored.data(),
+                      extent.storedLength, decoded.data(), extent.length))
+    return false;
+  const uint64_t fullBytes = totalBits / 8;
+  uint64_t length = extent.length;
+  // only the last extent can end in a partial byte, which must not
+  // overwrite the rest of that byte
+  if (extent.variableOffset + length > fullBytes) {
+    length = fullBytes - extent.variableOffset;
+    const uint8_t keep = (uint8_t)(0xff << (totalBits % 8));
+    data[fullBytes] =
+        (data[fullBytes] & keep) | ((uint8_t)decoded[length] & ~keep);
   }
+  memcpy(data + extent.variableOffset, decoded.data(), length);
+  return true;
+}
 
-  // body
-  if (!(file >> aliasesTo)) { // read numElements
-    std::cerr
-        << "*** ACRIiL - Restart has failed - header(aliasesTo) - aborted ***"
-        << std::endl;
-    exit(-1);
+void __acriilRestartReadPointerFromCheckpoint(uint64_t sizeBits,
+                                              uint64_t numElements,
+                                              uint8_t *data) {
+  ACRIiLVariableEntry &entry =
+      __acriilRestartNextEntry(0, sizeBits, numElements);
+  const uint64_t start = state.getTimeInMicroseconds();
+  uint64_t storedBytes = 0;
+  // read the data, the extents may be spread over several containers and
+  // are verified as they are read
+  const uint64_t totalBits = sizeBits * numElements;
+  std::vector<std::function<bool()>> tasks;
+  for (uint64_t e = 0; e < entry.numExtents; e++) {
+    ACRIiLExtentEntry &extent = state.restartExtents[entry.firstExtent + e];
+    const int fd = state.getRestartFd(extent.checkpoint);
+    storedBytes += extent.storedLength;
+    if (extent.storedLength != extent.length) {
+      tasks.push_back([&entry, &extent, fd, data, totalBits] {
+        return __acriilReadEncodedExtent(entry, extent, fd, data, totalBits);
+      });
+    } else {
+      tasks.push_back([&extent, fd, data, totalBits] {
+        return __acriilReadRawExtent(extent, fd, data, totalBits);
+      });
+    }
   }
-
-  if (!(file >> std::ws)) {
-    std::cerr << "*** ACRIiL - Restart has failed - EOF - aborted ***"
+  if (!state.runTasks(tasks)) {
+    std::cerr << "*** ACRIiL - Restart has failed - body - aborted ***"
               << std::endl;
     exit(-1);
   }
-  file.close();
+  state.recordStats("read", -1, -1, entry.index, entry.length, storedBytes,
+                    state.getTimeInMicroseconds() - start);
+  state.setAlias(data);
+}
 
-  uint8_t *out = state.getAlias(aliasesTo);
+uint8_t *__acriilRestartReadAliasFromCheckpoint(uint64_t sizeBits,
+                                                uint64_t numElements) {
+  ACRIiLVariableEntry &entry =
+      __acriilRestartNextEntry(1, sizeBits, numElements);
+
+  // interior pointers are rebuilt from the restored variable they point into
+  uint8_t *out = state.getAlias(entry.aliasesTo) + entry.aliasOffset;
   state.setAlias(out);
   return out;
 }
 
 void __acriilRestartFinish() { state.restartFinish(); }
+
+void __acriilRestartSite(uint64_t numVariables, uint64_t *descriptors) {
+  for (uint64_t i = 0; i < numVariables; i++) {
+    uint64_t *descriptor = descriptors + 4 * i;
+    if (descriptor[0] == ACRIIL_DESCRIPTOR_ALIAS) {
+      descriptor[3] = (uintptr_t)__acriilRestartReadAliasFromCheckpoint(
+          descriptor[1], descriptor[2]);
+    } else {
+      __acriilRestartReadPointerFromCheckpoint(
+          descriptor[1], descriptor[2], (uint8_t *)(uintptr_t)descriptor[3]);
+    }
+  }
+  __acriilRestartFinish();
+}
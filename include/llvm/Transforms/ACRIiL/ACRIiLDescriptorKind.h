@@ -0,0 +1,15 @@
+#ifndef LLVM_TRANSFORMS_ACRIIL_ACRIILDESCRIPTORKIND_H
+#define LLVM_TRANSFORMS_ACRIIL_ACRIILDESCRIPTORKIND_H
+
+#include <stdint.h>
+
+// Kinds of the descriptors of a checkpoint site. The pass emits them and the
+// runtime in acriil_dyn reads them, so this header must not depend on LLVM.
+enum ACRIiLDescriptorKind : uint64_t {
+  ACRIIL_DESCRIPTOR_POINTER = 0,
+  ACRIIL_DESCRIPTOR_INVARIANT_POINTER = 1,
+  ACRIIL_DESCRIPTOR_ALIAS = 2,
+  ACRIIL_DESCRIPTOR_SCRATCH = 3
+};
+
+#endif
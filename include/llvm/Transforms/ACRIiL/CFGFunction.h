@@ -4,8 +4,10 @@
 
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
@@ -37,13 +39,26 @@ public:
   Module &getParentLLVMModule();
   std::map<Value *, PointerAliasInfo *> &getPointerInformation();
   std::set<CFGNode *> &getNodesToCheckpoint();
+  std::set<BasicBlock *> &getCheckpointLoopBlocks(CFGNode &node);
+  bool isInvariantPointer(CFGNode &node, Value *pointer);
+  std::map<Value *, std::vector<Value *>> &getScratchPointers(CFGNode &node);
 
 private:
-  std::set<BasicBlock *> findCheckpointPoints(ModulePass *mp);
+  std::map<BasicBlock *, std::set<BasicBlock *>>
+  findCheckpointPoints(ModulePass *mp);
   CFGNode &addNode(BasicBlock &b, bool isPhiNode);
-  void setUpCFG(std::set<BasicBlock *> checkpointBlocks);
+  void
+  setUpCFG(std::map<BasicBlock *, std::set<BasicBlock *>> checkpointBlocks);
   void doLiveAnalysis();
   void pointerAnalysis(TargetLibraryInfo &TLI, ModulePass *mp);
+  void invariantPointerAnalysis(TargetLibraryInfo &TLI, ModulePass *mp);
+  void scratchPointerAnalysis(ModulePass *mp);
+  void removeUnusedSizePHIs();
+  bool findAllocations(Value *pointer, std::set<Value *> &allocations);
+  bool isScratchPointer(CFGNode &node, Value *pointer,
+                        std::set<Value *> &liveValues, ScalarEvolution &SE,
+                        LoopInfo &LI, DominatorTree &DT, AAResults &AA,
+                        std::vector<Value *> &candidates);
   void setUpLiveSetsAndMappings();
   Function &function;
   std::vector<CFGNode *> nodes;
@@ -51,6 +66,16 @@ private:
   CFGModule &module;
   std::map<Value *, PointerAliasInfo *> pointerInformation;
   std::set<CFGNode *> nodesToCheckpoint;
+  // blocks of the loop each checkpoint node is the header of
+  std::map<CFGNode *, std::set<BasicBlock *>> checkpointLoopBlocks;
+  // allocations which are not written to inside the loop of a checkpoint node
+  std::map<CFGNode *, std::set<Value *>> invariantPointers;
+  // memory the loop of a checkpoint node overwrites before reading it, with
+  // the pointers the loop reads through until then, which must not overlap it
+  std::map<CFGNode *, std::map<Value *, std::vector<Value *>>>
+      scratchPointers;
+  // the typeSizeInBits and numElements PHIs of pointer PHIs
+  std::set<PHINode *> sizePHIs;
 };
 
 } // namespace llvm
@@ -20,6 +20,7 @@ public:
   Module &getLLVMModule();
   std::map<Function *, CFGFunction *> &getFunctions();
   CFGFunction &getEntryFunction();
+  Function &getEntryLLVMFunction();
 
 private:
   void setUpCFGs(ModulePass *mp);
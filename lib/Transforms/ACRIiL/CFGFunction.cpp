@@ -2,12 +2,17 @@
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Argument.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/ACRIiL/ACRIiLAllocaManager.h"
 #include "llvm/Transforms/ACRIiL/ACRIiLPointerAlias.h"
@@ -16,6 +21,7 @@
 #include "llvm/Transforms/ACRIiL/CFGUse.h"
 #include "llvm/Transforms/ACRIiL/CFGUtils.h"
 
+#include <algorithm>
 #include <map>
 #include <set>
 #include <vector>
@@ -29,8 +35,11 @@ CFGFunction::CFGFunction(Function &f, CFGModule &m, TargetLibraryInfo &TLI,
     return;
   pointerAnalysis(TLI, mp);
   setUpCFG(findCheckpointPoints(mp));
+  invariantPointerAnalysis(TLI, mp);
   doLiveAnalysis();
   setUpLiveSetsAndMappings();
+  scratchPointerAnalysis(mp);
+  removeUnusedSizePHIs();
 }
 
 CFGFunction::~CFGFunction() {
@@ -61,14 +70,16 @@ CFGNode *CFGFunction::findNodeByBasicBlock(BasicBlock &b) {
   return NULL;
 }
 
-std::set<BasicBlock *> CFGFunction::findCheckpointPoints(ModulePass *mp) {
-  std::set<BasicBlock *> result;
+std::map<BasicBlock *, std::set<BasicBlock *>>
+CFGFunction::findCheckpointPoints(ModulePass *mp) {
+  std::map<BasicBlock *, std::set<BasicBlock *>> result;
   LoopInfo &LI = mp->getAnalysis<LoopInfoWrapperPass>(function).getLoopInfo();
   for (LoopInfo::iterator it = LI.begin(); it != LI.end(); it++) {
     Loop *l = *it;
     // TODO for now only checkpoint the most outerloop
+    // keep the blocks of the loop, the LoopInfo does not outlive this call
     if (l->getLoopDepth() == 1)
-      result.insert(l->getHeader());
+      result[l->getHeader()].insert(l->block_begin(), l->block_end());
   }
   return result;
 }
@@ -153,6 +164,8 @@ void CFGFunction::pointerAnalysis(TargetLibraryInfo &TLI, ModulePass *mp) {
         }
         pointerInformation[phi] = new PHINodePointerAliasInfo(
             phiTypeSizeInBits, phiNumElements, aliasSet);
+        sizePHIs.insert(phiTypeSizeInBits);
+        sizePHIs.insert(phiNumElements);
         phis.insert(phi);
         unknownSizePHINodeAliasPointers.insert(phi);
       } else {
@@ -298,7 +311,8 @@ void CFGFunction::pointerAnalysis(TargetLibraryInfo &TLI, ModulePass *mp) {
   // }
 }
 
-void CFGFunction::setUpCFG(std::set<BasicBlock *> checkpointBlocks) {
+void CFGFunction::setUpCFG(
+    std::map<BasicBlock *, std::set<BasicBlock *>> checkpointBlocks) {
   // first need to prep basic blocks
   // if there are any phi instructions in the basicblock then
   // split the block
@@ -321,12 +335,20 @@ void CFGFunction::setUpCFG(std::set<BasicBlock *> checkpointBlocks) {
     BasicBlock *B = I->getParent();
     BasicBlock *newB = B->splitBasicBlock(I, B->getName() + ".no_phis");
     phiNodes.insert(B);
+    // the new block is in every loop the split block was in
+    for (std::pair<BasicBlock *const, std::set<BasicBlock *>> &loop :
+         checkpointBlocks) {
+      if (loop.second.count(B))
+        loop.second.insert(newB);
+    }
     // make sure when splitting blocks to change the blocks to checkpoint
     // otherwise we will try to checkpoint PHI nodes which will not work
-    std::set<BasicBlock *>::iterator it = checkpointBlocks.find(B);
+    std::map<BasicBlock *, std::set<BasicBlock *>>::iterator it =
+        checkpointBlocks.find(B);
     if (it != checkpointBlocks.end()) {
-      checkpointBlocks.erase(B);
-      checkpointBlocks.insert(newB);
+      std::set<BasicBlock *> loopBlocks = it->second;
+      checkpointBlocks.erase(it);
+      checkpointBlocks[newB] = loopBlocks;
     }
   }
 
@@ -335,8 +357,12 @@ void CFGFunction::setUpCFG(std::set<BasicBlock *> checkpointBlocks) {
   for (BasicBlock &B : function) {
     bool isPhiNode = phiNodes.find(&B) != phiNodes.end();
     CFGNode &node = addNode(B, isPhiNode);
-    if (checkpointBlocks.find(&B) != checkpointBlocks.end())
+    std::map<BasicBlock *, std::set<BasicBlock *>>::iterator it =
+        checkpointBlocks.find(&B);
+    if (it != checkpointBlocks.end()) {
       nodesToCheckpoint.insert(&node);
+      checkpointLoopBlocks[&node] = it->second;
+    }
   }
 
   // get all the edges
@@ -349,6 +375,315 @@ void CFGFunction::setUpCFG(std::set<BasicBlock *> checkpointBlocks) {
   }
 }
 
+void CFGFunction::invariantPointerAnalysis(TargetLibraryInfo &TLI,
+                                           ModulePass *mp) {
+  AAResults &AA =
+      mp->getAnalysis<AAResultsWrapperPass>(function).getAAResults();
+  for (CFGNode *node : nodesToCheckpoint) {
+    std::set<BasicBlock *> &loopBlocks = checkpointLoopBlocks[node];
+    // only instructions in the loop can modify memory between two
+    // checkpoints at its header
+    std::vector<Instruction *> writes;
+    for (BasicBlock *B : loopBlocks) {
+      for (Instruction &I : *B) {
+        if (I.mayWriteToMemory())
+          writes.push_back(&I);
+      }
+    }
+
+    for (std::pair<Value *const, PointerAliasInfo *> &pair :
+         pointerInformation) {
+      // only allocations are written to the checkpoint as payload
+      Instruction *allocation = dyn_cast<Instruction>(pair.first);
+      if (!allocation ||
+          (!isa<AllocaInst>(allocation) && !isAllocationFn(allocation, &TLI)))
+        continue;
+      // allocations inside the loop are different memory every iteration
+      if (loopBlocks.count(allocation->getParent()))
+        continue;
+      bool invariant = true;
+      for (Instruction *I : writes) {
+        if (isModSet(AA.getModRefInfo(I, MemoryLocation(allocation)))) {
+          invariant = false;
+          break;
+        }
+      }
+      if (invariant)
+        invariantPointers[node].insert(allocation);
+    }
+  }
+}
+
+void CFGFunction::scratchPointerAnalysis(ModulePass *mp) {
+  // every getAnalysis call reruns all the analyses of the function, so the
+  // results are only taken once the passes of all of them are known
+  ScalarEvolutionWrapperPass &SEP =
+      mp->getAnalysis<ScalarEvolutionWrapperPass>(function);
+  DominatorTreeWrapperPass &DTP =
+      mp->getAnalysis<DominatorTreeWrapperPass>(function);
+  LoopInfoWrapperPass &LIP = mp->getAnalysis<LoopInfoWrapperPass>(function);
+  AAResultsWrapperPass &AAP = mp->getAnalysis<AAResultsWrapperPass>(function);
+  ScalarEvolution &SE = SEP.getSE();
+  DominatorTree &DT = DTP.getDomTree();
+  LoopInfo &LI = LIP.getLoopInfo();
+  AAResults &AA = AAP.getAAResults();
+  for (CFGNode *node : nodesToCheckpoint) {
+    std::set<Value *> liveValues;
+    for (CFGUse use : node->getLiveValues())
+      liveValues.insert(use.getValue());
+    for (Value *pointer : liveValues) {
+      if (!pointer->getType()->isPointerTy() ||
+          !pointerInformation.count(pointer) ||
+          isInvariantPointer(*node, pointer))
+        continue;
+      std::vector<Value *> candidates;
+      if (isScratchPointer(*node, pointer, liveValues, SE, LI, DT, AA,
+                           candidates))
+        scratchPointers[node][pointer] = candidates;
+    }
+  }
+}
+
+// finds the allocations the pointer can point into, returns false if some of
+// them are not known
+bool CFGFunction::findAllocations(Value *pointer,
+                                  std::set<Value *> &allocations) {
+  std::map<Value *, PointerAliasInfo *>::iterator it =
+      pointerInformation.find(pointer);
+  if (it == pointerInformation.end())
+    return false;
+  // allocations, and the arguments of main, alias themselves
+  std::set<Value *> &aliasSet = it->second->getAliasSet();
+  if (aliasSet.count(pointer)) {
+    allocations.insert(pointer);
+    return true;
+  }
+  for (Value *alias : aliasSet) {
+    if (!allocations.count(alias) && !findAllocations(alias, allocations))
+      return false;
+  }
+  return true;
+}
+
+// The memory of a pointer does not have to be checkpointed at the loop header
+// if every iteration overwrites all of it before reading it. That is the case
+// when a store in an inner loop walks over the whole memory, starting at the
+// pointer, and nothing on the way reads the memory. Reads through other
+// pointers which might point into the memory are returned as candidates, the
+// runtime checks that they do not before leaving the memory out.
+bool CFGFunction::isScratchPointer(CFGNode &node, Value *pointer,
+                                   std::set<Value *> &liveValues,
+                                   ScalarEvolution &SE, LoopInfo &LI,
+                                   DominatorTree &DT, AAResults &AA,
+                                   std::vector<Value *> &candidates) {
+  std::set<Value *> allocations;
+  if (!findAllocations(pointer, allocations))
+    return false;
+  std::set<BasicBlock *> &loopBlocks = checkpointLoopBlocks[&node];
+  const DataLayout &DL = getParentLLVMModule().getDataLayout();
+  Type *i64Type = Type::getInt64Ty(getParentLLVMModule().getContext());
+  PointerAliasInfo *PAI = pointerInformation[pointer];
+  const SCEV *start = SE.getSCEV(pointer);
+  const SCEV *bits = SE.getMulExpr(
+      SE.getTruncateOrZeroExtend(SE.getSCEV(PAI->getTypeSizeInBits()),
+                                 i64Type),
+      SE.getTruncateOrZeroExtend(SE.getSCEV(PAI->getNumElements()),
+                                 i64Type));
+
+  // find the store which overwrites all of the memory
+  Loop *storeLoop = nullptr;
+  for (BasicBlock *B : loopBlocks) {
+    Loop *L = LI.getLoopFor(B);
+    if (!L || !L->getParentLoop() || !loopBlocks.count(L->getHeader()) ||
+        !L->getLoopLatch() || !DT.dominates(B, L->getLoopLatch()))
+      continue;
+    const SCEV *backedges = SE.getBackedgeTakenCount(L);
+    if (isa<SCEVCouldNotCompute>(backedges))
+      continue;
+    for (Instruction &I : *B) {
+      StoreInst *si = dyn_cast<StoreInst>(&I);
+      if (!si)
+        continue;
+      const uint64_t storeSize =
+          DL.getTypeStoreSize(si->getValueOperand()->getType());
+      const SCEVAddRecExpr *address =
+          dyn_cast<SCEVAddRecExpr>(SE.getSCEV(si->getPointerOperand()));
+      if (!address || address->getLoop() != L || !address->isAffine() ||
+          address->getStart() != start)
+        continue;
+      const SCEVConstant *step =
+          dyn_cast<SCEVConstant>(address->getStepRecurrence(SE));
+      if (!step || step->getValue()->getSExtValue() != (int64_t)storeSize)
+        continue;
+      // the store runs on every iteration which takes the backedge, and also
+      // on the last one if it comes before all the exits
+      const SCEV *count = SE.getTruncateOrZeroExtend(backedges, i64Type);
+      SmallVector<BasicBlock *, 4> exitingBlocks;
+      L->getExitingBlocks(exitingBlocks);
+      if (std::all_of(
+              exitingBlocks.begin(), exitingBlocks.end(),
+              [&](BasicBlock *exiting) { return DT.dominates(B, exiting); }))
+        count = SE.getAddExpr(count, SE.getConstant(i64Type, 1));
+      const SCEV *written =
+          SE.getMulExpr(count, SE.getConstant(i64Type, storeSize * 8));
+      if (SE.isKnownPredicate(ICmpInst::ICMP_UGE, written, bits) ||
+          SE.isLoopEntryGuardedByCond(L, ICmpInst::ICMP_UGE, written, bits)) {
+        storeLoop = L;
+        break;
+      }
+    }
+    if (storeLoop)
+      break;
+  }
+  if (!storeLoop)
+    return false;
+
+  // the reads which can come before the memory is overwritten are the ones
+  // in the loop of the store and the ones on the paths from the header which
+  // do not go through that loop
+  std::set<BasicBlock *> region(storeLoop->block_begin(),
+                                storeLoop->block_end());
+  std::vector<BasicBlock *> worklist(1, &node.getLLVMBasicBlock());
+  std::set<BasicBlock *> visited(worklist.begin(), worklist.end());
+  while (!worklist.empty()) {
+    BasicBlock *B = worklist.back();
+    worklist.pop_back();
+    region.insert(B);
+    // the caller might read the memory
+    if (isa<ReturnInst>(B->getTerminator()) && function.getName() != "main")
+      return false;
+    for (BasicBlock *S : successors(B)) {
+      if (S != storeLoop->getHeader() && visited.insert(S).second)
+        worklist.push_back(S);
+    }
+  }
+
+  for (BasicBlock *B : region) {
+    for (Instruction &I : *B) {
+      if (!I.mayReadFromMemory())
+        continue;
+      bool reads = false;
+      for (Value *allocation : allocations)
+        reads |= isRefSet(AA.getModRefInfo(&I, MemoryLocation(allocation)));
+      if (!reads)
+        continue;
+      // only reads through a known pointer can be left to the runtime
+      Value *address = nullptr;
+      if (LoadInst *li = dyn_cast<LoadInst>(&I))
+        address = li->getPointerOperand();
+      else if (MemTransferInst *mti = dyn_cast<MemTransferInst>(&I))
+        address = mti->getRawSource();
+      if (!address)
+        return false;
+      Value *object = GetUnderlyingObject(address, DL);
+      if (object == pointer || !pointerInformation.count(object))
+        return false;
+      // the runtime needs the address of the object at the header
+      Instruction *objectInstruction = dyn_cast<Instruction>(object);
+      if (!liveValues.count(object) &&
+          (!objectInstruction ||
+           loopBlocks.count(objectInstruction->getParent()) ||
+           !DT.dominates(objectInstruction->getParent(),
+                         &node.getLLVMBasicBlock())))
+        return false;
+      if (std::find(candidates.begin(), candidates.end(), object) ==
+          candidates.end())
+        candidates.push_back(object);
+    }
+  }
+  return true;
+}
+
+// The size PHIs are created for every pointer PHI, as the sizes of the other
+// pointers are only known once all of them are set up. Only the sizes of the
+// pointers which are checkpointed are needed, the others would be left in
+// the loops of the program, so they are removed again.
+void CFGFunction::removeUnusedSizePHIs() {
+  // the pointers the checkpoints can store, which are the live pointers, the
+  // pointers they alias and the pointers the scratch memory is checked
+  // against, only the entry function gets checkpoints
+  std::set<Value *> pointers;
+  std::vector<Value *> worklist;
+  for (CFGNode *node : nodesToCheckpoint) {
+    if (&function != &module.getEntryLLVMFunction())
+      break;
+    for (CFGUse use : node->getLiveValues()) {
+      if (!sizePHIs.count(dyn_cast<PHINode>(use.getValue())))
+        worklist.push_back(use.getValue());
+    }
+    for (std::pair<Value *const, std::vector<Value *>> &scratch :
+         scratchPointers[node])
+      worklist.insert(worklist.end(), scratch.second.begin(),
+                      scratch.second.end());
+  }
+  std::vector<PHINode *> usedSizePHIs;
+  while (!worklist.empty()) {
+    Value *pointer = worklist.back();
+    worklist.pop_back();
+    std::map<Value *, PointerAliasInfo *>::iterator it =
+        pointerInformation.find(pointer);
+    if (it == pointerInformation.end() || !pointers.insert(pointer).second)
+      continue;
+    PointerAliasInfo *PAI = it->second;
+    for (Value *size : {PAI->getTypeSizeInBits(), PAI->getNumElements()}) {
+      if (PHINode *phi = dyn_cast<PHINode>(size))
+        usedSizePHIs.push_back(phi);
+    }
+    worklist.insert(worklist.end(), PAI->getAliasSet().begin(),
+                    PAI->getAliasSet().end());
+  }
+
+  // a used size PHI needs the size PHIs it merges
+  std::set<PHINode *> unused = sizePHIs;
+  while (!usedSizePHIs.empty()) {
+    PHINode *phi = usedSizePHIs.back();
+    usedSizePHIs.pop_back();
+    if (!unused.erase(phi))
+      continue;
+    for (Value *incoming : phi->incoming_values()) {
+      if (PHINode *incomingPHI = dyn_cast<PHINode>(incoming))
+        usedSizePHIs.push_back(incomingPHI);
+    }
+  }
+  if (unused.empty())
+    return;
+
+  // forget the pointers which had their sizes in them
+  for (std::map<Value *, PointerAliasInfo *>::iterator it =
+           pointerInformation.begin();
+       it != pointerInformation.end();) {
+    if (unused.count(dyn_cast<PHINode>(it->second->getTypeSizeInBits())) ||
+        unused.count(dyn_cast<PHINode>(it->second->getNumElements()))) {
+      delete it->second;
+      it = pointerInformation.erase(it);
+    } else {
+      it++;
+    }
+  }
+  // and take them out of the live analysis
+  for (CFGNode *node : nodes) {
+    for (std::set<CFGUse> *uses :
+         {&node->use, &node->in, &node->out, &node->live}) {
+      for (std::set<CFGUse>::iterator it = uses->begin(); it != uses->end();) {
+        if (unused.count(dyn_cast<PHINode>(it->getValue())))
+          it = uses->erase(it);
+        else
+          it++;
+      }
+    }
+    for (PHINode *phi : unused) {
+      node->def.erase(phi);
+      node->liveValuesMap.erase(phi);
+    }
+  }
+  for (PHINode *phi : unused)
+    phi->dropAllReferences();
+  for (PHINode *phi : unused) {
+    sizePHIs.erase(phi);
+    phi->eraseFromParent();
+  }
+}
+
 void CFGFunction::doLiveAnalysis() {
   bool converged;
   do {
@@ -462,3 +797,18 @@ std::map<Value *, PointerAliasInfo *> &CFGFunction::getPointerInformation() {
 std::set<CFGNode *> &CFGFunction::getNodesToCheckpoint() {
   return nodesToCheckpoint;
 }
+
+std::set<BasicBlock *> &CFGFunction::getCheckpointLoopBlocks(CFGNode &node) {
+  return checkpointLoopBlocks[&node];
+}
+
+std::map<Value *, std::vector<Value *>> &
+CFGFunction::getScratchPointers(CFGNode &node) {
+  return scratchPointers[&node];
+}
+
+bool CFGFunction::isInvariantPointer(CFGNode &node, Value *pointer) {
+  std::map<CFGNode *, std::set<Value *>>::iterator it =
+      invariantPointers.find(&node);
+  return it != invariantPointers.end() && it->second.count(pointer);
+}
@@ -49,3 +49,5 @@ std::map<Function *, CFGFunction *> &CFGModule::getFunctions() {
 CFGFunction &CFGModule::getEntryFunction() {
   return *functions.find(&entryFunction)->second;
 }
+
+Function &CFGModule::getEntryLLVMFunction() { return entryFunction; }
@@ -1,6 +1,7 @@
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
@@ -11,6 +12,7 @@
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Linker/Linker.h"
@@ -19,17 +21,25 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/ACRIiL.h"
 #include "llvm/Transforms/ACRIiL/ACRIiLAllocaManager.h"
+#include "llvm/Transforms/ACRIiL/ACRIiLDescriptorKind.h"
 #include "llvm/Transforms/ACRIiL/ACRIiLUtils.h"
 #include "llvm/Transforms/ACRIiL/CFGModule.h"
 #include "llvm/Transforms/IPO/Internalize.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 
+#include <algorithm>
 #include <iterator>
 #include <set>
 
 #define SHOW_CFG 0
+// weight of the path into a checkpoint or a restart against the path which
+// carries on, the same as __builtin_expect uses
+#define ACRIIL_UNLIKELY_WEIGHT 1
+#define ACRIIL_LIKELY_WEIGHT 2000
 
 using namespace llvm;
 
@@ -45,7 +55,24 @@ struct ACRIiLPass : public ModulePass {
     int64_t checkpointLabel;
     std::map<Value *, Value *> checkpointedToRestoreMap;
     std::map<Value *, uint64_t> checkpointedToIndexMap;
-    uint64_t nextCheckpointLabel = 0;
+    // the scalars are packed into a record, which is the first variable
+    uint64_t nextCheckpointLabel = 1;
+    // the site is checkpointed and restored by a single runtime call which
+    // walks a table of i64 descriptors, the arrays are sized once all live
+    // values are visited
+    AllocaInst *record = nullptr;
+    uint64_t recordSize = 0;
+    AllocaInst *checkpointTable = nullptr;
+    AllocaInst *restartTable = nullptr;
+    std::vector<Value *> checkpointDescriptors;
+    std::vector<Value *> restartDescriptors;
+    // go in front of the checkpoint descriptors
+    std::vector<Value *> scratchDescriptors;
+    // values live at the node and the pointers the runtime has to know the
+    // index of as alias candidates
+    std::set<Value *> liveValues;
+    std::set<Value *> aliasCandidates;
+    std::map<Value *, bool> rematerializable;
     CheckpointRestartBlockHelper(CFGNode &node, CFGNode &checkpointNode,
                                  CFGNode &restartNode, int64_t checkpointLabel)
         : node(node), checkpointNode(checkpointNode), restartNode(restartNode),
@@ -56,20 +83,21 @@ struct ACRIiLPass : public ModulePass {
       checkpointedToIndexMap[from] = nextCheckpointLabel++;
     }
 
+    void addScalarToCheckpointMap(Value *from, Value *to) {
+      checkpointedToRestoreMap[from] = to;
+    }
+
     void addConstantToCheckpointMap(Value *constant) {
       checkpointedToRestoreMap[constant] = constant;
     }
   };
 
   Function *acriilCheckpointSetup;
-  Function *acriilCheckpointStart;
-  Function *acriilCheckpointPointer;
-  Function *acriilCheckpointAlias;
-  Function *acriilCheckpointFinish;
+  Function *acriilCheckpointSite;
   Function *acriilRestartGetLabel;
   Function *acriilRestartReadPointerFromCheckpoint;
-  Function *acriilRestartReadAliasFromCheckpoint;
-  Function *acriilRestartFinish;
+  Function *acriilRestartSite;
+  GlobalVariable *acriilCheckpointDue;
 
   // commonly used types
   IntegerType *i64Type;
@@ -133,13 +161,8 @@ struct ACRIiLPass : public ModulePass {
 
     // load the checkpointing functions
     acriilCheckpointSetup = M.getFunction("__acriilCheckpointSetup");
-    acriilCheckpointStart = M.getFunction("__acriilCheckpointStart");
-    acriilCheckpointPointer = M.getFunction("__acriilCheckpointPointer");
-    acriilCheckpointAlias = M.getFunction("__acriilCheckpointAlias");
-    acriilCheckpointFinish = M.getFunction("__acriilCheckpointFinish");
-    if (!acriilCheckpointSetup || !acriilCheckpointStart ||
-        !acriilCheckpointPointer || !acriilCheckpointFinish ||
-        !acriilCheckpointAlias) {
+    acriilCheckpointSite = M.getFunction("__acriilCheckpointSite");
+    if (!acriilCheckpointSetup || !acriilCheckpointSite) {
       errs() << "could not load the checkpointing functions, checkpointing "
                 "will not be added\n";
       return false;
@@ -148,15 +171,20 @@ struct ACRIiLPass : public ModulePass {
     acriilRestartGetLabel = M.getFunction("__acriilRestartGetLabel");
     acriilRestartReadPointerFromCheckpoint =
         M.getFunction("__acriilRestartReadPointerFromCheckpoint");
-    acriilRestartReadAliasFromCheckpoint =
-        M.getFunction("__acriilRestartReadAliasFromCheckpoint");
-    acriilRestartFinish = M.getFunction("__acriilRestartFinish");
+    acriilRestartSite = M.getFunction("__acriilRestartSite");
     if (!acriilRestartGetLabel || !acriilRestartReadPointerFromCheckpoint ||
-        !acriilRestartReadAliasFromCheckpoint || !acriilRestartFinish) {
+        !acriilRestartSite) {
       errs() << "could not load the restarting functions, checkpointing will "
                 "not be added\n";
       return false;
     }
+    // load the flag which says that a checkpoint is due
+    acriilCheckpointDue = M.getGlobalVariable("__acriilCheckpointDue");
+    if (!acriilCheckpointDue) {
+      errs() << "could not load the checkpoint due flag, checkpointing will "
+                "not be added\n";
+      return false;
+    }
     bool changed = addCheckpointsToFunction(cfgModule.getEntryFunction());
     return changed;
   }
@@ -185,7 +213,14 @@ struct ACRIiLPass : public ModulePass {
     }
 
     // now need to fix dominanance
-    fixDominance(cfgFunction);
+    fixDominance(cfgFunction, checkpointAndRestartBlocks);
+
+    // only the guard stays in the loop, the checkpoint and restart blocks
+    // become calls to cold functions
+    for (CheckpointRestartBlockHelper CRBH : checkpointAndRestartBlocks) {
+      outlineColdBlock(CRBH.checkpointNode.getLLVMBasicBlock());
+      outlineColdBlock(CRBH.restartNode.getLLVMBasicBlock());
+    }
 #if SHOW_CFG == 1
     cfgFunction.getLLVMFunction().viewCFG();
 #endif
@@ -196,18 +231,36 @@ struct ACRIiLPass : public ModulePass {
   createCheckpointAndRestartBlocksForNode(CFGNode *node,
                                           int64_t checkpointLabel) {
     BasicBlock &B = node->getLLVMBasicBlock();
+    // add a block which checks whether a checkpoint is due
+    BasicBlock *guardBlock = BasicBlock::Create(
+        node->getParentLLVMModule().getContext(),
+        B.getName() + ".checkpoint_due", &node->getParentLLVMFunction());
     // add a checkpoint block
     BasicBlock *checkpointBlock = BasicBlock::Create(
         node->getParentLLVMModule().getContext(), B.getName() + ".checkpoint",
         &node->getParentLLVMFunction());
-    // make sure all predecessors of B now point at the checkpoint
+    // make sure all predecessors of B now point at the guard
     for (BasicBlock *p : predecessors(&B)) {
       for (unsigned i = 0; i < p->getTerminator()->getNumSuccessors(); i++) {
         if (p->getTerminator()->getSuccessor(i) == &B) {
-          p->getTerminator()->setSuccessor(i, checkpointBlock);
+          p->getTerminator()->setSuccessor(i, guardBlock);
         }
       }
     }
+    // when no checkpoint is due only the flag is loaded, the load is volatile
+    // so that it is not hoisted out of the loop
+    {
+      IRBuilder<> builder(guardBlock);
+      Value *due = builder.CreateLoad(acriilCheckpointDue, true,
+                                      "checkpoint_due");
+      Value *isDue = builder.CreateICmpNE(
+          due, Constant::getNullValue(due->getType()), "is_checkpoint_due");
+      builder.CreateCondBr(
+          isDue, checkpointBlock, &B,
+          MDBuilder(B.getContext())
+              .createBranchWeights(ACRIIL_UNLIKELY_WEIGHT,
+                                   ACRIIL_LIKELY_WEIGHT));
+    }
     // add a branch instruction from the end of the checkpoint block to the
     // original block
     BranchInst::Create(&B, checkpointBlock);
@@ -219,6 +272,9 @@ struct ACRIiLPass : public ModulePass {
     // add a branch instruction from the end of the checkpoint block to the
     // original block
     BranchInst::Create(&B, restartBlock);
+    // the guard does not change any values, so it is set up like a
+    // checkpoint node
+    node->getParentFunction().addCheckpointNode(*guardBlock, *node);
     CFGNode &checkpointNode =
         node->getParentFunction().addCheckpointNode(*checkpointBlock, *node);
     CFGNode &restartNode =
@@ -269,27 +325,96 @@ struct ACRIiLPass : public ModulePass {
     // happened
     SwitchInst *si = builder.CreateSwitch(ciGetLabel, noCREntry,
                                           checkpointAndRestartBlocks.size());
+    // a restart happens at most once per run, the default is the hot path
+    std::vector<uint32_t> weights(1, ACRIIL_LIKELY_WEIGHT);
     for (CheckpointRestartBlockHelper CRBH : checkpointAndRestartBlocks) {
       si->addCase(
           ConstantInt::get(cfgFunction.getParentLLVMModule().getContext(),
                            APInt(64, CRBH.checkpointLabel, true)),
           &CRBH.restartNode.getLLVMBasicBlock());
+      weights.push_back(ACRIIL_UNLIKELY_WEIGHT);
     }
+    si->setMetadata(LLVMContext::MD_prof,
+                    MDBuilder(cfgFunction.getParentLLVMModule().getContext())
+                        .createBranchWeights(weights));
 
     // add the noCREntry block into the CFG
     cfgFunction.addNoCREntryNode(*noCREntry);
   }
 
+  // an array of i64 in the entry block, its size is set once it is known
+  AllocaInst *createSiteArray(CheckpointRestartBlockHelper &CRBH,
+                              const Twine &name) {
+    return new AllocaInst(
+        i64Type, 0, ConstantInt::get(i64Type, 1, false), name,
+        &CRBH.node.getParentLLVMFunction().getEntryBlock().front());
+  }
+
+  // stores the descriptors into the table in front of the site call
+  void storeDescriptors(std::vector<Value *> &descriptors, AllocaInst *table,
+                        IRBuilder<> &builder) {
+    table->setOperand(0, ConstantInt::get(i64Type, descriptors.size(), false));
+    for (uint64_t i = 0; i < descriptors.size(); i++)
+      builder.CreateStore(descriptors[i],
+                          builder.CreateConstGEP1_64(table, i));
+  }
+
   void
   fillCheckpointAndRestartBlocksForNode(CheckpointRestartBlockHelper &CRBH) {
-    IRBuilder<> builderCheckpointBlock(
-        &CRBH.checkpointNode.getLLVMBasicBlock());
-    IRBuilder<> builderRestartBlock(&CRBH.restartNode.getLLVMBasicBlock());
-    // insert instructions before the branch
-    builderCheckpointBlock.SetInsertPoint(
-        &CRBH.checkpointNode.getLLVMBasicBlock().front());
-    builderRestartBlock.SetInsertPoint(
-        &CRBH.restartNode.getLLVMBasicBlock().front());
+    BasicBlock &checkpointBlock = CRBH.checkpointNode.getLLVMBasicBlock();
+    BasicBlock &restartBlock = CRBH.restartNode.getLLVMBasicBlock();
+    CRBH.record = createSiteArray(CRBH, "acriil.record");
+    CRBH.checkpointTable = createSiteArray(CRBH, "acriil.checkpoint_table");
+    CRBH.restartTable = createSiteArray(CRBH, "acriil.restart_table");
+    // the blocks only have their branch at this point, the site calls go in
+    // front of it and everything for the live values in front of the calls
+    IRBuilder<> builderCheckpointBlock(checkpointBlock.getTerminator());
+    CallInst *checkpointSite = builderCheckpointBlock.CreateCall(
+        acriilCheckpointSite,
+        {ConstantInt::get(i64Type, CRBH.checkpointLabel, true),
+         ConstantInt::get(i64Type, 0, false), CRBH.checkpointTable});
+    builderCheckpointBlock.SetInsertPoint(checkpointSite);
+    // the restart reads the record first, the sizes of the pointers are in it
+    IRBuilder<> builderRestartBlock(restartBlock.getTerminator());
+    CallInst *restartRecord = builderRestartBlock.CreateCall(
+        acriilRestartReadPointerFromCheckpoint,
+        {ConstantInt::get(i64Type, 64, false),
+         ConstantInt::get(i64Type, 0, false),
+         builderRestartBlock.CreateBitCast(CRBH.record, i8PType)});
+    CallInst *restartSite = builderRestartBlock.CreateCall(
+        acriilRestartSite,
+        {ConstantInt::get(i64Type, 0, false), CRBH.restartTable});
+    builderRestartBlock.SetInsertPoint(restartSite);
+
+    // the record is the first variable of the checkpoint
+    CRBH.checkpointDescriptors.push_back(
+        ConstantInt::get(i64Type, ACRIIL_DESCRIPTOR_POINTER, false));
+    CRBH.checkpointDescriptors.push_back(ConstantInt::get(i64Type, 64, false));
+    CRBH.checkpointDescriptors.push_back(ConstantInt::get(i64Type, 0, false));
+    CRBH.checkpointDescriptors.push_back(
+        builderCheckpointBlock.CreatePtrToInt(CRBH.record, i64Type));
+    CRBH.checkpointDescriptors.push_back(ConstantInt::get(i64Type, 0, false));
+    // the runtime finds aliases among the checkpointed pointers, so those
+    // which are candidates of any live pointer cannot be rematerialized
+    std::map<Value *, PointerAliasInfo *> &pointerInformation =
+        CRBH.node.getParentFunction().getPointerInformation();
+    std::vector<Value *> worklist;
+    for (CFGUse live : CRBH.node.getLiveValues()) {
+      CRBH.liveValues.insert(live.getValue());
+      worklist.push_back(live.getValue());
+    }
+    while (!worklist.empty()) {
+      Value *pointer = worklist.back();
+      worklist.pop_back();
+      std::map<Value *, PointerAliasInfo *>::iterator it =
+          pointerInformation.find(pointer);
+      if (it == pointerInformation.end())
+        continue;
+      for (Value *alias : it->second->getAliasSet()) {
+        if (alias != pointer && CRBH.aliasCandidates.insert(alias).second)
+          worklist.push_back(alias);
+      }
+    }
     // for every live variable
     // errs() << "****Start checkpointing - "
     //        << CRBH.node.getLLVMBasicBlock().getName() << "\n";
@@ -298,28 +423,31 @@ struct ACRIiLPass : public ModulePass {
                                  builderRestartBlock);
     }
     // errs() << "****End checkpointing\n";
-
-    // add extra checkpoint calls
-    // set up the checkpoint block
-    // firstly call the start checkpoint function
-    {
-      std::vector<Value *> args;
-      args.push_back(ConstantInt::get(i64Type, CRBH.checkpointLabel, true));
-      args.push_back(ConstantInt::get(i64Type, CRBH.nextCheckpointLabel, true));
-      builderCheckpointBlock.SetInsertPoint(
-          &CRBH.checkpointNode.getLLVMBasicBlock().front());
-      builderCheckpointBlock.CreateCall(acriilCheckpointStart, args);
-    }
-    // add a checkpoint clean up call at the end
-    {
-      std::vector<Value *> args;
-      builderCheckpointBlock.SetInsertPoint(
-          &CRBH.checkpointNode.getLLVMBasicBlock().back());
-      builderCheckpointBlock.CreateCall(acriilCheckpointFinish, args);
-      builderRestartBlock.SetInsertPoint(
-          &CRBH.restartNode.getLLVMBasicBlock().back());
-      builderRestartBlock.CreateCall(acriilRestartFinish, args);
+    // memory the loop overwrites before reading it does not have to be
+    // stored, unless what the loop reads on the way overlaps it
+    for (std::pair<Value *const, std::vector<Value *>> &scratch :
+         CRBH.node.getParentFunction().getScratchPointers(CRBH.node)) {
+      addCheckpointScratchInstructionsToBlock(scratch.first, scratch.second,
+                                              CRBH, builderCheckpointBlock);
     }
+
+    // now the sizes are known
+    Value *words =
+        ConstantInt::get(i64Type, (CRBH.recordSize + 7) / 8, false);
+    CRBH.record->setOperand(0, words);
+    CRBH.checkpointDescriptors[2] = words;
+    restartRecord->setArgOperand(1, words);
+    CRBH.checkpointDescriptors.insert(CRBH.checkpointDescriptors.begin(),
+                                      CRBH.scratchDescriptors.begin(),
+                                      CRBH.scratchDescriptors.end());
+    storeDescriptors(CRBH.checkpointDescriptors, CRBH.checkpointTable,
+                     builderCheckpointBlock);
+    checkpointSite->setArgOperand(
+        1, ConstantInt::get(i64Type, CRBH.nextCheckpointLabel, false));
+    storeDescriptors(CRBH.restartDescriptors, CRBH.restartTable,
+                     builderRestartBlock);
+    restartSite->setArgOperand(
+        0, ConstantInt::get(i64Type, CRBH.nextCheckpointLabel - 1, false));
   }
 
   Value *checkpointRestoreLiveValue(Value *liveValue,
@@ -329,7 +457,10 @@ struct ACRIiLPass : public ModulePass {
     Value *restoreLiveValue = nullptr;
     // TODO at the moment assume that live values are instructions or constants
     if (ACRIiLUtils::isCheckpointableType(liveValue)) {
-      if (liveValue->getType()->isPtrOrPtrVectorTy()) {
+      if (isRematerializable(liveValue, CRBH)) {
+        restoreLiveValue = rematerializeLiveValue(
+            liveValue, CRBH, builderCheckpointBlock, builderRestartBlock);
+      } else if (liveValue->getType()->isPtrOrPtrVectorTy()) {
         restoreLiveValue = checkpointRestoreLiveValuePointer(
             liveValue, CRBH, builderCheckpointBlock, builderRestartBlock);
 
@@ -350,6 +481,83 @@ struct ACRIiLPass : public ModulePass {
     return restoreLiveValue;
   }
 
+  // Values which can be computed again in the restart block, from constants
+  // and from values which are live at the node anyway, are not checkpointed.
+  // These are side effect free instructions, GEPs and bitcasts of pointers
+  // which are not alias candidates, and PHIs which merge a single value, like
+  // the size PHIs of pointers.
+  bool isRematerializable(Value *value, CheckpointRestartBlockHelper &CRBH) {
+    std::map<Value *, bool>::iterator it = CRBH.rematerializable.find(value);
+    if (it != CRBH.rematerializable.end())
+      return it->second;
+    bool result = false;
+    Instruction *i = dyn_cast<Instruction>(value);
+    if (!i) {
+      result = false;
+    } else if (PHINode *phi = dyn_cast<PHINode>(i)) {
+      result = !phi->getType()->isPtrOrPtrVectorTy() && phi->hasConstantValue();
+    } else if (i->getType()->isPtrOrPtrVectorTy()) {
+      // the base pointer is checkpointed, the indices have to be recomputable
+      result = (isa<GetElementPtrInst>(i) || isa<BitCastInst>(i)) &&
+               !CRBH.aliasCandidates.count(i) &&
+               CRBH.node.getParentFunction().getPointerInformation().count(
+                   i->getOperand(0));
+      for (unsigned op = 1; result && op < i->getNumOperands(); op++)
+        result = isRematerializableOperand(i->getOperand(op), CRBH);
+    } else if (isa<BinaryOperator>(i) || isa<CastInst>(i) ||
+               isa<CmpInst>(i) || isa<SelectInst>(i)) {
+      result = true;
+      for (Value *op : i->operands()) {
+        result = result && !op->getType()->isPtrOrPtrVectorTy() &&
+                 isRematerializableOperand(op, CRBH);
+      }
+    }
+    CRBH.rematerializable[value] = result;
+    return result;
+  }
+
+  bool isRematerializableOperand(Value *op,
+                                 CheckpointRestartBlockHelper &CRBH) {
+    return isa<Constant>(op) || CRBH.liveValues.count(op) ||
+           isRematerializable(op, CRBH);
+  }
+
+  Value *rematerializeLiveValue(Value *liveValue,
+                                CheckpointRestartBlockHelper &CRBH,
+                                IRBuilder<> &builderCheckpointBlock,
+                                IRBuilder<> &builderRestartBlock) {
+    if (CRBH.checkpointedToRestoreMap.find(liveValue) !=
+        CRBH.checkpointedToRestoreMap.end())
+      return CRBH.checkpointedToRestoreMap.find(liveValue)->second;
+
+    Value *restored = nullptr;
+    if (PHINode *phi = dyn_cast<PHINode>(liveValue)) {
+      restored = checkpointRestoreLiveValue(phi->hasConstantValue(), CRBH,
+                                            builderCheckpointBlock,
+                                            builderRestartBlock);
+    } else {
+      Instruction *i = cast<Instruction>(liveValue);
+      Instruction *clone = i->clone();
+      for (unsigned op = 0; op < i->getNumOperands(); op++) {
+        clone->setOperand(op, checkpointRestoreLiveValue(
+                                  i->getOperand(op), CRBH,
+                                  builderCheckpointBlock, builderRestartBlock));
+      }
+      // restored aliases are only known after the site call, which is just
+      // before the terminator
+      if (i->getType()->isPtrOrPtrVectorTy()) {
+        IRBuilder<> pointerBuilder(
+            CRBH.restartNode.getLLVMBasicBlock().getTerminator());
+        pointerBuilder.Insert(clone, i->getName() + ".restart");
+      } else {
+        builderRestartBlock.Insert(clone, i->getName() + ".restart");
+      }
+      restored = clone;
+    }
+    CRBH.addScalarToCheckpointMap(liveValue, restored);
+    return restored;
+  }
+
   Value *checkpointRestoreLiveValuePointer(Value *liveValue,
                                            CheckpointRestartBlockHelper &CRBH,
                                            IRBuilder<> &builderCheckpointBlock,
@@ -392,12 +600,15 @@ struct ACRIiLPass : public ModulePass {
     Instruction *i = cast<Instruction>(liveValue);
     TargetLibraryInfo &TLI =
         getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
+    // memory which the loop never writes to only has to be stored once
+    bool isInvariant =
+        CRBH.node.getParentFunction().isInvariantPointer(CRBH.node, liveValue);
     if (isAllocationFn(i, &TLI)) {
       CallInst *mallocLive = extractMallocCall(i, &TLI);
       // checkpoint
       addCheckpointPointerInstructionsToBlock(
           mallocLive, PAI->getTypeSizeInBits(), PAI->getNumElements(),
-          builderCheckpointBlock);
+          isInvariant, CRBH, builderCheckpointBlock);
       // restore
       // clone the malloc instruction into restore block
       CallInst *mallocRestore = cast<CallInst>(mallocLive->clone());
@@ -406,7 +617,7 @@ struct ACRIiLPass : public ModulePass {
       builderRestartBlock.Insert(mallocRestore,
                                  mallocLive->getName() + ".restart");
       addRestorePointerInstructionsToBlock(mallocRestore, restoreTypeSizeInBits,
-                                           restoreNumElements,
+                                           restoreNumElements, CRBH,
                                            builderRestartBlock);
       restoreLiveValue = mallocRestore;
       CRBH.addToCheckpointMap(liveValue, mallocRestore);
@@ -417,13 +628,13 @@ struct ACRIiLPass : public ModulePass {
         // checkpoint
         addCheckpointPointerInstructionsToBlock(
             aiLive, PAI->getTypeSizeInBits(), PAI->getNumElements(),
-            builderCheckpointBlock);
+            isInvariant, CRBH, builderCheckpointBlock);
         // restore
         // clone the allocating instruction into restore block
         AllocaInst *aiRestore = cast<AllocaInst>(aiLive->clone());
         builderRestartBlock.Insert(aiRestore, aiLive->getName() + ".restart");
         addRestorePointerInstructionsToBlock(aiRestore, restoreTypeSizeInBits,
-                                             restoreNumElements,
+                                             restoreNumElements, CRBH,
                                              builderRestartBlock);
         restoreLiveValue = aiRestore;
         CRBH.addToCheckpointMap(liveValue, aiRestore);
@@ -435,10 +646,8 @@ struct ACRIiLPass : public ModulePass {
         addCheckpointAliasInstructionsToBlock(phiLive, PAI, CRBH,
                                               builderCheckpointBlock);
         // restore
-        Value *restoredBC = addRestoreAliasInstructionsToBlock(
-            restoreTypeSizeInBits, restoreNumElements, builderRestartBlock);
-        Value *restored = builderRestartBlock.CreateBitCast(
-            restoredBC, phiLive->getType(), phiLive->getName() + ".restart");
+        Value *restored = addRestoreAliasInstructionsToBlock(
+            restoreTypeSizeInBits, restoreNumElements, phiLive, CRBH);
         restoreLiveValue = restored;
         CRBH.addToCheckpointMap(liveValue, restored);
         break;
@@ -449,10 +658,8 @@ struct ACRIiLPass : public ModulePass {
         addCheckpointAliasInstructionsToBlock(gepLive, PAI, CRBH,
                                               builderCheckpointBlock);
         // restore
-        Value *restoredBC = addRestoreAliasInstructionsToBlock(
-            restoreTypeSizeInBits, restoreNumElements, builderRestartBlock);
-        Value *restored = builderRestartBlock.CreateBitCast(
-            restoredBC, gepLive->getType(), gepLive->getName() + ".restart");
+        Value *restored = addRestoreAliasInstructionsToBlock(
+            restoreTypeSizeInBits, restoreNumElements, gepLive, CRBH);
         restoreLiveValue = restored;
         CRBH.addToCheckpointMap(liveValue, restored);
         break;
@@ -463,10 +670,8 @@ struct ACRIiLPass : public ModulePass {
         addCheckpointAliasInstructionsToBlock(bcLive, PAI, CRBH,
                                               builderCheckpointBlock);
         // restore
-        Value *restoredBC = addRestoreAliasInstructionsToBlock(
-            restoreTypeSizeInBits, restoreNumElements, builderRestartBlock);
-        Value *restored = builderRestartBlock.CreateBitCast(
-            restoredBC, bcLive->getType(), bcLive->getName() + ".restart");
+        Value *restored = addRestoreAliasInstructionsToBlock(
+            restoreTypeSizeInBits, restoreNumElements, bcLive, CRBH);
         restoreLiveValue = restored;
         CRBH.addToCheckpointMap(liveValue, restored);
         break;
@@ -494,28 +699,23 @@ struct ACRIiLPass : public ModulePass {
       return CRBH.checkpointedToRestoreMap.find(liveValue)->second;
     }
 
-    // if the live value is not a pointer, then store it in some memory
-    // First alloca an array with just one element
-    AllocaInst *ai = CRBH.node.getParentFunction().getAllocManager().getAlloca(
-        liveValue->getType());
-    Value *typeSizeInBits = ConstantInt::get(
-        i64Type,
-        CRBH.node.getParentLLVMModule().getDataLayout().getTypeSizeInBits(
-            liveValue->getType()),
-        false);
-    Value *numElements = ConstantInt::get(i64Type, 1, false);
+    // if the live value is not a pointer, then it is packed into the record
+    // of the site, the record is 8 byte aligned
+    const DataLayout &DL = CRBH.node.getParentLLVMModule().getDataLayout();
+    Type *type = liveValue->getType();
+    const uint64_t align =
+        std::min<uint64_t>(DL.getABITypeAlignment(type), 8);
+    const uint64_t offset = (CRBH.recordSize + align - 1) / align * align;
+    CRBH.recordSize = offset + DL.getTypeStoreSize(type);
     // checkpoint
-    // store the value in that alloca
-    builderCheckpointBlock.CreateStore(liveValue, ai);
-    addCheckpointPointerInstructionsToBlock(ai, typeSizeInBits, numElements,
-                                            builderCheckpointBlock);
-    // restore
-    addRestorePointerInstructionsToBlock(ai, typeSizeInBits, numElements,
-                                         builderRestartBlock);
-    LoadInst *li =
-        builderRestartBlock.CreateLoad(ai, liveValue->getName() + ".restart");
-    CRBH.addToCheckpointMap(liveValue, li);
-    CRBH.node.getParentFunction().getAllocManager().releaseAlloca(ai);
+    builderCheckpointBlock.CreateAlignedStore(
+        liveValue,
+        getRecordField(CRBH, offset, type, builderCheckpointBlock), align);
+    // restore, the record is read before anything else of the site
+    LoadInst *li = builderRestartBlock.CreateAlignedLoad(
+        getRecordField(CRBH, offset, type, builderRestartBlock), align,
+        liveValue->getName() + ".restart");
+    CRBH.addScalarToCheckpointMap(liveValue, li);
     return li;
   }
 
@@ -525,173 +725,204 @@ struct ACRIiLPass : public ModulePass {
     return liveValue;
   }
 
-  void addCheckpointPointerInstructionsToBlock(Value *valueToCheckpoint,
-                                               Value *typeSizeInBits,
-                                               Value *numElements,
-                                               IRBuilder<> &builder) {
-    // bitcast alloca to bytes
-    Value *bc = builder.CreateBitCast(valueToCheckpoint, i8PType,
-                                      valueToCheckpoint->getName() + ".i8");
-
-    std::vector<Value *> checkpointArgs;
-    checkpointArgs.push_back(typeSizeInBits);
-    checkpointArgs.push_back(numElements);
-    checkpointArgs.push_back(bc);
-    builder.CreateCall(acriilCheckpointPointer, checkpointArgs);
+  // pointer to a field of the record of a site
+  Value *getRecordField(CheckpointRestartBlockHelper &CRBH, uint64_t offset,
+                        Type *type, IRBuilder<> &builder) {
+    Value *field = builder.CreateConstGEP1_64(
+        builder.CreateBitCast(CRBH.record, i8PType), offset);
+    return builder.CreateBitCast(field, PointerType::get(type, 0));
+  }
+
+  void addCheckpointPointerInstructionsToBlock(
+      Value *valueToCheckpoint, Value *typeSizeInBits, Value *numElements,
+      bool isInvariant, CheckpointRestartBlockHelper &CRBH,
+      IRBuilder<> &builder) {
+    std::vector<Value *> &descriptors = CRBH.checkpointDescriptors;
+    descriptors.push_back(ConstantInt::get(
+        i64Type,
+        isInvariant ? ACRIIL_DESCRIPTOR_INVARIANT_POINTER
+                    : ACRIIL_DESCRIPTOR_POINTER,
+        false));
+    descriptors.push_back(typeSizeInBits);
+    descriptors.push_back(numElements);
+    descriptors.push_back(builder.CreatePtrToInt(
+        valueToCheckpoint, i64Type, valueToCheckpoint->getName() + ".int"));
+    descriptors.push_back(ConstantInt::get(i64Type, 0, false));
   }
 
   void addCheckpointAliasInstructionsToBlock(Value *valueToCheckpoint,
                                              PointerAliasInfo *PAI,
                                              CheckpointRestartBlockHelper &CRBH,
                                              IRBuilder<> &builder) {
-    // bitcast alloca to bytes
-    Value *bc = builder.CreateBitCast(valueToCheckpoint, i8PType,
-                                      valueToCheckpoint->getName() + ".i8");
-
-    std::vector<Value *> checkpointArgs;
-    checkpointArgs.push_back(
+    std::vector<Value *> &descriptors = CRBH.checkpointDescriptors;
+    descriptors.push_back(
+        ConstantInt::get(i64Type, ACRIIL_DESCRIPTOR_ALIAS, false));
+    descriptors.push_back(PAI->getTypeSizeInBits());
+    descriptors.push_back(PAI->getNumElements());
+    descriptors.push_back(builder.CreatePtrToInt(
+        valueToCheckpoint, i64Type, valueToCheckpoint->getName() + ".int"));
+    descriptors.push_back(
         ConstantInt::get(i64Type, PAI->getAliasSet().size(), false));
-    checkpointArgs.push_back(PAI->getTypeSizeInBits());
-    checkpointArgs.push_back(PAI->getNumElements());
-    checkpointArgs.push_back(bc);
+    // followed by the candidates the pointer can alias
     for (Value *alias : PAI->getAliasSet()) {
       PointerAliasInfo *aliasPAI =
           CRBH.node.getParentFunction().getPointerInformation()[alias];
-      Value *aliasBC =
-          builder.CreateBitCast(alias, i8PType, alias->getName() + ".i8");
-      checkpointArgs.push_back(aliasPAI->getTypeSizeInBits());
-      checkpointArgs.push_back(aliasPAI->getNumElements());
-      checkpointArgs.push_back(
+      descriptors.push_back(aliasPAI->getTypeSizeInBits());
+      descriptors.push_back(aliasPAI->getNumElements());
+      descriptors.push_back(
           ConstantInt::get(i64Type, CRBH.checkpointedToIndexMap[alias], false));
-      checkpointArgs.push_back(aliasBC);
+      descriptors.push_back(
+          builder.CreatePtrToInt(alias, i64Type, alias->getName() + ".int"));
+    }
+  }
+
+  void addCheckpointScratchInstructionsToBlock(
+      Value *pointer, std::vector<Value *> &candidates,
+      CheckpointRestartBlockHelper &CRBH, IRBuilder<> &builder) {
+    std::map<Value *, PointerAliasInfo *> &pointerInformation =
+        CRBH.node.getParentFunction().getPointerInformation();
+    std::vector<Value *> &descriptors = CRBH.scratchDescriptors;
+    PointerAliasInfo *PAI = pointerInformation[pointer];
+    descriptors.push_back(
+        ConstantInt::get(i64Type, ACRIIL_DESCRIPTOR_SCRATCH, false));
+    descriptors.push_back(PAI->getTypeSizeInBits());
+    descriptors.push_back(PAI->getNumElements());
+    descriptors.push_back(
+        builder.CreatePtrToInt(pointer, i64Type, pointer->getName() + ".int"));
+    descriptors.push_back(ConstantInt::get(i64Type, candidates.size(), false));
+    // the pointers the loop reads through before overwriting the memory
+    for (Value *candidate : candidates) {
+      PointerAliasInfo *candidatePAI = pointerInformation[candidate];
+      descriptors.push_back(candidatePAI->getTypeSizeInBits());
+      descriptors.push_back(candidatePAI->getNumElements());
+      descriptors.push_back(ConstantInt::get(i64Type, 0, false));
+      descriptors.push_back(builder.CreatePtrToInt(
+          candidate, i64Type, candidate->getName() + ".int"));
     }
-    builder.CreateCall(acriilCheckpointAlias, checkpointArgs);
   }
 
   void addRestorePointerInstructionsToBlock(Value *valueToRestore,
                                             Value *typeSizeInBits,
                                             Value *numElements,
+                                            CheckpointRestartBlockHelper &CRBH,
                                             IRBuilder<> &builder) {
-    // bitcast it to bytes
-    Value *bc = builder.CreateBitCast(valueToRestore, i8PType,
-                                      valueToRestore->getName() + ".i8");
-    std::vector<Value *> restartArgs;
-    restartArgs.push_back(typeSizeInBits);
-    restartArgs.push_back(numElements);
-    restartArgs.push_back(bc);
-
-    builder.CreateCall(acriilRestartReadPointerFromCheckpoint, restartArgs);
+    std::vector<Value *> &descriptors = CRBH.restartDescriptors;
+    descriptors.push_back(
+        ConstantInt::get(i64Type, ACRIIL_DESCRIPTOR_POINTER, false));
+    descriptors.push_back(typeSizeInBits);
+    descriptors.push_back(numElements);
+    descriptors.push_back(builder.CreatePtrToInt(
+        valueToRestore, i64Type, valueToRestore->getName() + ".int"));
   }
 
-  Value *addRestoreAliasInstructionsToBlock(Value *typeSizeInBits,
-                                            Value *numElements,
-                                            IRBuilder<> &builder) {
-    std::vector<Value *> restartArgs;
-    restartArgs.push_back(typeSizeInBits);
-    restartArgs.push_back(numElements);
+  // the runtime stores the restored alias into its descriptor, so it is
+  // loaded after the site call, which is just before the terminator
+  Value *
+  addRestoreAliasInstructionsToBlock(Value *typeSizeInBits, Value *numElements,
+                                     Value *aliasLive,
+                                     CheckpointRestartBlockHelper &CRBH) {
+    std::vector<Value *> &descriptors = CRBH.restartDescriptors;
+    const uint64_t slot = descriptors.size() + 3;
+    descriptors.push_back(
+        ConstantInt::get(i64Type, ACRIIL_DESCRIPTOR_ALIAS, false));
+    descriptors.push_back(typeSizeInBits);
+    descriptors.push_back(numElements);
+    descriptors.push_back(ConstantInt::get(i64Type, 0, false));
+
+    IRBuilder<> aliasBuilder(
+        CRBH.restartNode.getLLVMBasicBlock().getTerminator());
+    Value *restored = aliasBuilder.CreateLoad(
+        aliasBuilder.CreateConstGEP1_64(CRBH.restartTable, slot));
+    return aliasBuilder.CreateIntToPtr(restored, aliasLive->getType(),
+                                       aliasLive->getName() + ".restart");
+  }
 
-    return builder.CreateCall(acriilRestartReadAliasFromCheckpoint,
-                              restartArgs);
+  // moves a filled checkpoint or restart block into a function of its own,
+  // the stores of the descriptors and the values packed into the record then
+  // do not take up registers or code size in the loop around it
+  void outlineColdBlock(BasicBlock &block) {
+    BasicBlock *blocks[] = {&block};
+    CodeExtractor extractor(blocks);
+    Function *outlined =
+        extractor.isEligible() ? extractor.extractCodeRegion() : nullptr;
+    if (!outlined) {
+      errs() << "could not outline " << block.getName()
+             << ", it is left in place\n";
+      return;
+    }
+    outlined->removeFnAttr(Attribute::AlwaysInline);
+    outlined->removeFnAttr(Attribute::InlineHint);
+    outlined->addFnAttr(Attribute::Cold);
+    outlined->addFnAttr(Attribute::NoInline);
+    outlined->addFnAttr(Attribute::OptimizeForSize);
+    for (User *user : outlined->users()) {
+      if (CallInst *call = dyn_cast<CallInst>(user))
+        call->addAttribute(AttributeList::FunctionIndex, Attribute::Cold);
+    }
   }
 
-  void fixDominance(CFGFunction &cfgFunction) {
-    // struct used for dominance fixing
-    struct PHINodeMappingToUpdate {
-      PHINode &phi;    // phi to fix
-      Value *value;    // mapping from
-      unsigned phiIdx; // index of the phi value
-      PHINodeMappingToUpdate(PHINode &p, Value *v, unsigned pI)
-          : phi(p), value(v), phiIdx(pI) {}
-    };
-
-    // Step 1.
-    // If    a phi node with the live variable as a value already exists then
-    // only schedule it for updating  Else  in each block, for each live
-    // variable create a phi with a value from each of the predecessors
-    // If a node with phi with the live variable as a value already exists then
-    // only schedule it for updating.
-    // Else in each block, for each live variable
-    //      create a phi with a value from each of the predecessors
-    std::vector<PHINodeMappingToUpdate> phisToUpdate;
-    for (CFGNode *node : cfgFunction.getNodes()) {
-      for (CFGUse live : node->getLiveValues()) {
+  // Every restart block defines a second value for each value it restores,
+  // the original and the restored values only meet where a path from a
+  // restart block joins the paths the original value reaches. SSAUpdater
+  // places PHIs at those joins and nowhere else, and rewrites the uses below
+  // them.
+  void fixDominance(CFGFunction &cfgFunction,
+                    std::vector<CheckpointRestartBlockHelper>
+                        &checkpointAndRestartBlocks) {
+    // the restored values of each value, by restart block, in the order the
+    // sites are visited so that the PHIs are created in a stable order
+    std::vector<Value *> restoredValues;
+    std::map<Value *, std::map<BasicBlock *, Value *>> restores;
+    for (CheckpointRestartBlockHelper &CRBH : checkpointAndRestartBlocks) {
+      for (CFGUse live : CRBH.node.getLiveValues()) {
         Value *value = live.getValue();
-
-        if (live.getUseType() == CFGUseType::PHIOnly) {
-          for (PHINode &phi : node->getLLVMBasicBlock().phis()) {
-            for (unsigned phiIdx = 0; phiIdx < phi.getNumIncomingValues();
-                 phiIdx++) {
-              if (phi.getIncomingValue(phiIdx) == value) {
-                phisToUpdate.push_back(
-                    PHINodeMappingToUpdate(phi, value, phiIdx));
-              }
-            }
-          }
-        } else {
-          // otherwise if phi does not exist, need to create a new one
-          // phi node for this live variable
-          PHINode *phi = PHINode::Create(
-              value->getType(),
-              std::distance(pred_begin(&node->getLLVMBasicBlock()),
-                            pred_end(&node->getLLVMBasicBlock())),
-              value->getName() + "." + node->getLLVMBasicBlock().getName(),
-              &node->getLLVMBasicBlock().front());
-          // update the uses
-          for (Instruction &inst : node->getLLVMBasicBlock()) {
-            for (unsigned i = 0; i < inst.getNumOperands(); i++) {
-              if (inst.getOperand(i) == value)
-                inst.setOperand(i, phi);
-            }
-          }
-
-          // add the values that need to be updated with the mappings
-          unsigned phiIdx = 0;
-          for (BasicBlock *pred : predecessors(&node->getLLVMBasicBlock())) {
-            phi->addIncoming(Constant::getNullValue(value->getType()), pred);
-            phisToUpdate.push_back(
-                PHINodeMappingToUpdate(*phi, value, phiIdx++));
-          }
-          node->addLiveMapping(value, phi);
-        }
+        Value *restored = CRBH.restartNode.getLiveMapping(value);
+        if (!ACRIiLUtils::isCheckpointableType(value) || restored == value)
+          continue;
+        if (!restores.count(value))
+          restoredValues.push_back(value);
+        restores[value][&CRBH.restartNode.getLLVMBasicBlock()] = restored;
       }
     }
 
-    // Step 2.
-    // Now that all phi nodes have been created with correct mappings, update
-    // the mappings in the phi nodes
-    for (PHINodeMappingToUpdate ptu : phisToUpdate) {
-      // todo assume instruction for now only
-      if (!ACRIiLUtils::isCheckpointableType(ptu.value))
-        continue;
-      CFGNode *pred = cfgFunction.findNodeByBasicBlock(
-          *ptu.phi.getIncomingBlock(ptu.phiIdx));
-      ptu.phi.setIncomingValue(ptu.phiIdx, pred->getLiveMapping(ptu.value));
-    }
-
-    // Step 3.
-    // Clean up phi nodes which were created that have only one input
-    bool removed = false;
-    do {
-      removed = false;
-      for (CFGNode *node : cfgFunction.getNodes()) {
-        std::vector<PHINode *> phis;
-        for (PHINode &phi : node->getLLVMBasicBlock().phis()) {
-          if (phi.hasConstantValue())
-            phis.push_back(&phi);
-        }
-        for (PHINode *phi : phis) {
-          phi->replaceAllUsesWith(phi->hasConstantValue());
-          phi->eraseFromParent();
-          removed = true;
-        }
+    for (Value *value : restoredValues) {
+      std::map<BasicBlock *, Value *> &restoredIn = restores[value];
+      // arguments are available from the entry block on, which is where the
+      // restart blocks branch from
+      BasicBlock *defBlock =
+          isa<Instruction>(value)
+              ? cast<Instruction>(value)->getParent()
+              : &cfgFunction.getLLVMFunction().getEntryBlock();
+      SSAUpdater updater;
+      updater.Initialize(value->getType(), value->getName());
+      updater.AddAvailableValue(defBlock, value);
+      for (std::pair<BasicBlock *const, Value *> &restore : restoredIn)
+        updater.AddAvailableValue(restore.first, restore.second);
+      // rewriting a use changes the use list, so collect them first
+      std::vector<Use *> uses;
+      for (Use &use : value->uses())
+        uses.push_back(&use);
+      for (Use *use : uses) {
+        Instruction *user = dyn_cast<Instruction>(use->getUser());
+        if (!user)
+          continue;
+        BasicBlock *useBlock = user->getParent();
+        // the restart blocks only use what they restore, and uses in the
+        // defining block come after the definition
+        if (restoredIn.count(useBlock) ||
+            (useBlock == defBlock && !isa<PHINode>(user)))
+          continue;
+        updater.RewriteUse(*use);
       }
-    } while (removed);
+    }
   }
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.addRequired<TargetLibraryInfoWrapperPass>();
     AU.addRequired<AAResultsWrapperPass>();
     AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
   }
 };
 } // namespace
@@ -702,6 +933,8 @@ INITIALIZE_PASS_BEGIN(ACRIiLPass, "ACRIiL",
 INITIALIZE_PASS_DEPENDENCY(TargetLibraryInfoWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(AAResultsWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(LoopInfoWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(ScalarEvolutionWrapperPass)
 INITIALIZE_PASS_END(ACRIiLPass, "ACRIiL",
                     "Automatic Checkpoint/Restart Insertion Pass", false, false)
 